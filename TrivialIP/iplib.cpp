@@ -1,21 +1,25 @@
 #include "iplib.h"
+#include <opencv2/core/hal/intrin.hpp>
 
-// Applies an affine transformation to an image.
-//
-// no flags, default to INTER_LINEAR, i.e., bilinear interpolation
-// M.type() must be CV_64FC1
-void warpAffine(const cv::Mat& src, cv::Mat& dst, const cv::Mat& M, cv::Size& dsize) {
-	const int eps = 1e-9;
-	int row = src.rows;
-	int col = src.cols;
-	int channel = src.channels();
-
-	if (channel != 3) {
-		std::cerr << "src image's num of channels is not 3!" << std::endl;
-		return;
-	}
+// fixed-point layout used by the warp kernels
+// source coordinates are 16.16, bilinear weights use 7 fractional bits,
+// so the four products of one output pixel sum up to 1 << 14
+const int WARP_FIX_BITS = 16;
+const int WARP_INTER_BITS = 7;
+const int WARP_INTER_SIZE = 1 << WARP_INTER_BITS;
+const int WARP_COEF_BITS = 2 * WARP_INTER_BITS;
+const int WARP_FRAC_SHIFT = WARP_FIX_BITS - WARP_INTER_BITS;
+// fractional bits of the bicubic and Lanczos-3 weights of 8-bit images, the
+// weighted sum of 6x6 taps then stays within 255 * 1.55^2 << 20 and fits in int
+const int WARP_HI_BITS = 10;
+// the box pre-reduction of large downscales stops at 2^11 per axis, bilinear takes
+// the rest, so that the sum of an 8-bit box fits in int
+const int WARP_BOX_MAX_LEVELS = 11;
 
-	// some coefficients
+// invert the 2x3 forward matrix M, i.e., dst -> src mapping
+// sx = inv[0] * x + inv[1] * y + inv[2]
+// sy = inv[3] * x + inv[4] * y + inv[5]
+static bool invert_affine(const cv::Mat& M, double inv[6]) {
 	double a = M.at<double>(0, 0);
 	double b = M.at<double>(0, 1);
 	double c = M.at<double>(1, 0);
@@ -24,231 +28,4110 @@ void warpAffine(const cv::Mat& src, cv::Mat& dst, const cv::Mat& M, cv::Size& ds
 	double ty = M.at<double>(1, 2);
 	double det = a * d - b * c;
 
-	// resize dst image
-	int resized_row = (int)(row * sqrt(c * c + d * d) + eps);
-	int resized_col = (int)(col * sqrt(a * a + b * b) + eps);
-	dst = cv::Mat::zeros(resized_row, resized_col, CV_8UC3);
+	if (std::abs(det) < 1e-12) {
+		return false;
+	}
 
-	// parameters for loop
-	int _x, _y;
-	double dx, dy;
-	double x_original, y_original;
+	inv[0] = d / det;
+	inv[1] = -b / det;
+	inv[2] = (b * ty - d * tx) / det;
+	inv[3] = -c / det;
+	inv[4] = a / det;
+	inv[5] = (c * tx - a * ty) / det;
+	return true;
+}
 
-	// affine transformation
-	// i is on y axis, j is on x axis
-	for (int i = 0; i < resized_row; i++) {
-		for (int j = 0; j < resized_col; j++) {
-			// original point
-			// -1 for binear interpolation
-			x_original = (d * j - b * i + ty * b - tx * d) / det;
-			y_original = (a * i - c * j + tx * c - ty * a) / det;
-			if ((x_original < 0) || (x_original >= col - 1)) {
-				continue;
-			}
-			if ((y_original < 0) || (y_original >= row - 1)) {
-				continue;
-			}
+// round to 16.16, kept in 64 bits so that far away row starts do not overflow
+static inline int64 warp_fix(double v) {
+	return (int64)std::floor(v * (1 << WARP_FIX_BITS) + 0.5);
+}
 
-			// binear interpolation
-			_x = (int)x_original;
-			_y = (int)y_original;
-			dx = x_original - _x;
-			dy = y_original - _y;
-			for (int c = 0; c < channel; c++) {
-				dst.at<cv::Vec3b>(i, j)[c] = (1 - dx) * (1 - dy) * src.at<cv::Vec3b>(_y, _x)[c] +
-					dx * (1 - dy) * src.at<cv::Vec3b>(_y, _x + 1)[c] +
-					(1 - dx) * dy * src.at<cv::Vec3b>(_y + 1, _x)[c] +
-					dx * dy * src.at<cv::Vec3b>(_y + 1, _x + 1)[c];
-			}
-		}
+// per depth arithmetic of the warp kernels
+// integer depths blend the fixed-point weights in int, 65535 << WARP_COEF_BITS
+// still fits, and round to nearest; float blends the same weights in float
+template<typename T>
+struct WarpDepth {
+	// sum of weighted taps
+	typedef int work_type;
+	// horizontally blended row of warp_scale
+	typedef int row_type;
+
+	static T round(int v) {
+		return cv::saturate_cast<T>((v + (1 << (WARP_COEF_BITS - 1))) >> WARP_COEF_BITS);
+	}
+
+	// sums of the box reduction
+	typedef int64 box_type;
+
+	// mean of a box of 2^bits pixels from its sum, and of n pixels for boxes cut by
+	// the border, rounded
+	static T box(int64 v, int bits) {
+		return (T)((v + ((int64)1 << bits >> 1)) >> bits);
+	}
+
+	static T mean(int64 v, int n) {
+		return (T)((v + n / 2) / n);
+	}
+
+	// bicubic and Lanczos-3 weights and sums, the negative lobes can overshoot
+	typedef float hi_coef_type;
+	typedef float hi_work_type;
+
+	static T round_hi(float v) {
+		return cv::saturate_cast<T>(v);
+	}
+};
+
+template<>
+struct WarpDepth<uchar> {
+	typedef int work_type;
+	// 255 << WARP_INTER_BITS fits, which halves the row cache and allows 16-bit lanes
+	typedef ushort row_type;
+
+	static uchar round(int v) {
+		return cv::saturate_cast<uchar>((v + (1 << (WARP_COEF_BITS - 1))) >> WARP_COEF_BITS);
+	}
+
+	// 255 << 2 * WARP_BOX_MAX_LEVELS fits
+	typedef int box_type;
+
+	static uchar box(int v, int bits) {
+		return (uchar)((v + (1 << bits >> 1)) >> bits);
+	}
+
+	static uchar mean(int v, int n) {
+		return (uchar)((v + n / 2) / n);
+	}
+
+	typedef short hi_coef_type;
+	typedef int hi_work_type;
+
+	static uchar round_hi(int v) {
+		return cv::saturate_cast<uchar>((v + (1 << (2 * WARP_HI_BITS - 1))) >> (2 * WARP_HI_BITS));
+	}
+};
+
+template<>
+struct WarpDepth<float> {
+	typedef float work_type;
+	typedef float row_type;
+
+	static float round(float v) {
+		return v * (1.f / (1 << WARP_COEF_BITS));
+	}
+
+	typedef double box_type;
+
+	static float box(double v, int bits) {
+		return (float)(v * (1.0 / (1 << bits)));
+	}
+
+	static float mean(double v, int n) {
+		return (float)(v / n);
+	}
+
+	typedef float hi_coef_type;
+	typedef float hi_work_type;
+
+	static float round_hi(float v) {
+		return v;
+	}
+};
+
+// bilinear interpolation of one pixel from its top-left tap p
+// fx, fy are the weights of the right and lower taps, 0..WARP_INTER_SIZE
+// sstep is the row step in elements
+template<typename T, int cn>
+static inline void warp_bilinear_taps(const T* p, size_t sstep, int fx, int fy, T* dst) {
+	typedef typename WarpDepth<T>::work_type WT;
+	for (int c = 0; c < cn; c++) {
+		WT top = p[c] * (WARP_INTER_SIZE - fx) + p[c + cn] * fx;
+		WT bot = p[sstep + c] * (WARP_INTER_SIZE - fx) + p[sstep + c + cn] * fx;
+		dst[c] = WarpDepth<T>::round(top * (WARP_INTER_SIZE - fy) + bot * fy);
 	}
 }
 
-// calculate the histogram of a grey scale image
-// return a Mat that can be directly plotted
-cv::Mat cal_hist_grey(const cv::Mat& img) {
-	cv::Mat hist_img = cv::Mat(hist_height, hist_width, CV_8UC3, cv::Scalar(225, 228, 255));
-	int frequency[256] = { 0 };
-	double hist[256], hist_max;
+// bilinear interpolation of one pixel
+// (X, Y) is the 16.16 source coordinate, both taps of each axis must be inside src
+template<typename T, int cn>
+static inline void warp_bilinear_pixel(const T* src, size_t sstep, int X, int Y, T* dst) {
+	const T* p = src + (size_t)(Y >> WARP_FIX_BITS) * sstep + (X >> WARP_FIX_BITS) * cn;
+	int fx = (X >> WARP_FRAC_SHIFT) & (WARP_INTER_SIZE - 1);
+	int fy = (Y >> WARP_FRAC_SHIFT) & (WARP_INTER_SIZE - 1);
+	warp_bilinear_taps<T, cn>(p, sstep, fx, fy, dst);
+}
+
+// bilinear interpolation of one pixel on the last row or column of src
+// the second tap is clamped, its weight is zero there anyway
+template<typename T, int cn>
+static inline void warp_bilinear_pixel_edge(const cv::Mat& src, int X, int Y, T* dst) {
+	typedef typename WarpDepth<T>::work_type WT;
+	int sx = X >> WARP_FIX_BITS, sy = Y >> WARP_FIX_BITS;
+	const T* p0 = src.ptr<T>(sy) + sx * cn;
+	const T* p1 = src.ptr<T>(std::min(sy + 1, src.rows - 1)) + sx * cn;
+	int dx = sx + 1 < src.cols ? cn : 0;
+	int fx = (X >> WARP_FRAC_SHIFT) & (WARP_INTER_SIZE - 1);
+	int fy = (Y >> WARP_FRAC_SHIFT) & (WARP_INTER_SIZE - 1);
+
+	for (int c = 0; c < cn; c++) {
+		WT top = p0[c] * (WARP_INTER_SIZE - fx) + p0[c + dx] * fx;
+		WT bot = p1[c] * (WARP_INTER_SIZE - fx) + p1[c + dx] * fx;
+		dst[c] = WarpDepth<T>::round(top * (WARP_INTER_SIZE - fy) + bot * fy);
+	}
+}
+
+// vectorized parts of the kernels, each one returns the number of pixels it did
+// only 8-bit images have them, these fallbacks leave everything to the scalar loops
+template<int cn, typename T>
+static inline int warp_bilinear_row_simd(const T*, size_t, T*, int, int, int, int, int) {
+	return 0;
+}
+template<int cn, typename T>
+static inline int warp_table_row_simd(const T*, size_t, const int*, const ushort*, T*, int) {
+	return 0;
+}
+template<int cn, typename T>
+static inline int warp_reverse_row_simd(const T*, T*, int) {
+	return 0;
+}
+template<typename R, typename T>
+static inline int warp_scale_vert_simd(const R*, const R*, int, T*, int) {
+	return 0;
+}
+template<typename T, typename A>
+static inline int warp_box_cols_simd(const T*, const T*, A*, int, bool) {
+	return 0;
+}
+template<int cn, typename A>
+static inline int warp_box_fold_simd(A*, int) {
+	return 0;
+}
+template<typename A, typename T>
+static inline int warp_box_mean_simd(const A*, T*, int, int) {
+	return 0;
+}
+
+#if CV_SIMD128 && !defined(IPLIB_DISABLE_SIMD)
+// load 16 pixels as one plane per channel
+template<int cn> static inline void warp_load_pixels(const uchar* src, cv::v_uint8x16* res);
+template<> inline void warp_load_pixels<1>(const uchar* src, cv::v_uint8x16* res) {
+	res[0] = cv::v_load(src);
+}
+template<> inline void warp_load_pixels<3>(const uchar* src, cv::v_uint8x16* res) {
+	cv::v_load_deinterleave(src, res[0], res[1], res[2]);
+}
+template<> inline void warp_load_pixels<4>(const uchar* src, cv::v_uint8x16* res) {
+	cv::v_load_deinterleave(src, res[0], res[1], res[2], res[3]);
+}
+
+// store 16 pixels given as one plane per channel
+template<int cn> static inline void warp_store_pixels(uchar* dst, const cv::v_uint8x16* res);
+template<> inline void warp_store_pixels<1>(uchar* dst, const cv::v_uint8x16* res) {
+	cv::v_store(dst, res[0]);
+}
+template<> inline void warp_store_pixels<3>(uchar* dst, const cv::v_uint8x16* res) {
+	cv::v_store_interleave(dst, res[0], res[1], res[2]);
+}
+template<> inline void warp_store_pixels<4>(uchar* dst, const cv::v_uint8x16* res) {
+	cv::v_store_interleave(dst, res[0], res[1], res[2], res[3]);
+}
+#endif
+
+#if CV_SIMD128 && !defined(IPLIB_DISABLE_SIMD)
+// bilinear interpolation of 16 pixels whose top-left taps are at sdata + ofs[k]
+// the taps are gathered into planar buffers and blended in 16-bit lanes,
+// the arithmetic is exactly the one of warp_bilinear_taps
+template<int cn>
+static inline void warp_bilinear_block(const uchar* sdata, size_t sstep, const int* ofs,
+	const cv::v_uint16x8 fx[2], const cv::v_uint16x8 fy[2], uchar* dst) {
+	using namespace cv;
+	uchar CV_DECL_ALIGNED(16) taps[4][cn][16];
+	const v_uint16x8 v_one = v_setall_u16(WARP_INTER_SIZE);
+	const v_int32x4 v_round = v_setall_s32(1 << (WARP_COEF_BITS - 1));
 
-	for (int i = 0; i < img.rows; i++) {
-		for (int j = 0; j < img.cols; j++) {
-			frequency[img.at<uchar>(i, j)]++;
+	for (int k = 0; k < 16; k++) {
+		const uchar* p = sdata + ofs[k];
+		for (int c = 0; c < cn; c++) {
+			taps[0][c][k] = p[c];
+			taps[1][c][k] = p[c + cn];
+			taps[2][c][k] = p[sstep + c];
+			taps[3][c][k] = p[sstep + c + cn];
 		}
 	}
 
-	hist_max = -1;
-	for (int i = 0; i <= 255; i++) {
-		hist[i] = (double)frequency[i] / (img.rows * img.cols);
-		if (hist[i] > hist_max)
-			hist_max = hist[i];
+	v_int16x8 wyy[4];
+	v_zip(v_reinterpret_as_s16(v_one - fy[0]), v_reinterpret_as_s16(fy[0]), wyy[0], wyy[1]);
+	v_zip(v_reinterpret_as_s16(v_one - fy[1]), v_reinterpret_as_s16(fy[1]), wyy[2], wyy[3]);
+
+	v_uint8x16 res[cn];
+	for (int c = 0; c < cn; c++) {
+		v_uint16x8 t00[2], t01[2], t10[2], t11[2];
+		v_expand(v_load_aligned(taps[0][c]), t00[0], t00[1]);
+		v_expand(v_load_aligned(taps[1][c]), t01[0], t01[1]);
+		v_expand(v_load_aligned(taps[2][c]), t10[0], t10[1]);
+		v_expand(v_load_aligned(taps[3][c]), t11[0], t11[1]);
+
+		v_int16x8 out[2];
+		for (int h = 0; h < 2; h++) {
+			// rows are blended in 16 bits, max 255 * 128 fits into int16
+			v_uint16x8 top = v_mul_wrap(t00[h], v_one - fx[h]) + v_mul_wrap(t01[h], fx[h]);
+			v_uint16x8 bot = v_mul_wrap(t10[h], v_one - fx[h]) + v_mul_wrap(t11[h], fx[h]);
+			v_int16x8 tb0, tb1;
+			v_zip(v_reinterpret_as_s16(top), v_reinterpret_as_s16(bot), tb0, tb1);
+			v_int32x4 s0 = (v_dotprod(tb0, wyy[2 * h]) + v_round) >> WARP_COEF_BITS;
+			v_int32x4 s1 = (v_dotprod(tb1, wyy[2 * h + 1]) + v_round) >> WARP_COEF_BITS;
+			out[h] = v_pack(s0, s1);
+		}
+		res[c] = v_pack_u(out[0], out[1]);
 	}
 
-	for (int i = 0; i < 255; i++) {
-		cv::line(hist_img, cv::Point(i * bin_width, (int)(hist_height * (1 - hist[i] / hist_max))),
-			cv::Point((i + 1) * bin_width, (int)(hist_height * (1 - hist[i + 1] / hist_max))),
-			cv::Scalar(205, 0, 0), 2, cv::LINE_AA);
+	warp_store_pixels<cn>(dst, res);
+}
+#endif
+
+#if CV_SIMD128 && !defined(IPLIB_DISABLE_SIMD)
+// 16 pixels of warp_bilinear_row per iteration, coordinates and weights are
+// computed in vector registers
+template<int cn>
+static inline int warp_bilinear_row_simd(const uchar* sdata, size_t sstep, uchar* dst, int X, int Y, int DX, int DY, int n) {
+	using namespace cv;
+	const int VECSZ = 16;
+	int CV_DECL_ALIGNED(16) ofs[VECSZ];
+	ushort CV_DECL_ALIGNED(16) wx[VECSZ], wy[VECSZ];
+	const v_int32x4 v_step4 = v_setall_s32(4 * DX), v_stepy4 = v_setall_s32(4 * DY);
+	const v_int32x4 v_lane_dx = v_int32x4(0, DX, 2 * DX, 3 * DX);
+	const v_int32x4 v_lane_dy = v_int32x4(0, DY, 2 * DY, 3 * DY);
+	const v_int32x4 v_fmask = v_setall_s32(WARP_INTER_SIZE - 1);
+	const v_int32x4 v_sstep = v_setall_s32((int)sstep);
+	const v_int32x4 v_cn = v_setall_s32(cn);
+	int j = 0;
+
+	for (; j <= n - VECSZ; j += VECSZ) {
+		v_int32x4 vx = v_setall_s32(X + j * DX) + v_lane_dx;
+		v_int32x4 vy = v_setall_s32(Y + j * DY) + v_lane_dy;
+
+		for (int k = 0; k < VECSZ; k += 4, vx += v_step4, vy += v_stepy4) {
+			v_int32x4 sx = vx >> WARP_FIX_BITS, sy = vy >> WARP_FIX_BITS;
+			v_store_aligned(ofs + k, sy * v_sstep + sx * v_cn);
+			v_int32x4 fx = (vx >> WARP_FRAC_SHIFT) & v_fmask, fy = (vy >> WARP_FRAC_SHIFT) & v_fmask;
+			v_pack_store(wx + k, v_reinterpret_as_u32(fx));
+			v_pack_store(wy + k, v_reinterpret_as_u32(fy));
+		}
+
+		v_uint16x8 fx[2] = { v_load_aligned(wx), v_load_aligned(wx + 8) };
+		v_uint16x8 fy[2] = { v_load_aligned(wy), v_load_aligned(wy + 8) };
+		warp_bilinear_block<cn>(sdata, sstep, ofs, fx, fy, dst + j * cn);
 	}
+	return j;
+}
 
-	return hist_img;
+// 16 pixels of warp_table_row per iteration
+template<int cn>
+static inline int warp_table_row_simd(const uchar* sdata, size_t sstep, const int* ofs, const ushort* wts, uchar* dst, int n) {
+	using namespace cv;
+	const v_uint16x8 v_lo = v_setall_u16(0xff);
+	int j = 0;
+	for (; j <= n - 16; j += 16) {
+		v_uint16x8 w0 = v_load(wts + j), w1 = v_load(wts + j + 8);
+		v_uint16x8 fx[2] = { w0 & v_lo, w1 & v_lo };
+		v_uint16x8 fy[2] = { w0 >> 8, w1 >> 8 };
+		warp_bilinear_block<cn>(sdata, sstep, ofs + j, fx, fy, dst + j * cn);
+	}
+	return j;
 }
 
-// histogram equalization for grey scale image
-// only support CV_8U type now, i.e., 0..255
-cv::Mat histogram_equalization_grey(const cv::Mat& img) {
-	if (img.type() != CV_8U) {
-		std::cout << "histogram_equalization_grey: img's type is not CV_8U\n";
-		return img;
+// 16 pixels of warp_reverse_row per iteration
+template<int cn>
+static inline int warp_reverse_row_simd(const uchar* src, uchar* dst, int n) {
+	cv::v_uint8x16 v[cn];
+	int k = 0;
+	for (; k <= n - 16; k += 16) {
+		warp_load_pixels<cn>(src + (n - 16 - k) * cn, v);
+		for (int c = 0; c < cn; c++) {
+			v[c] = cv::v_reverse(v[c]);
+		}
+		warp_store_pixels<cn>(dst + k * cn, v);
+	}
+	return k;
+}
+
+// 16 values of the vertical pass of warp_scale per iteration
+static inline int warp_scale_vert_simd(const ushort* h0, const ushort* h1, int fy, uchar* out, int len) {
+	using namespace cv;
+	v_int16x8 wy = v_reinterpret_as_s16(v_setall_u32((unsigned)(WARP_INTER_SIZE - fy) | ((unsigned)fy << 16)));
+	v_int32x4 v_round = v_setall_s32(1 << (WARP_COEF_BITS - 1));
+	int k = 0;
+	for (; k <= len - 16; k += 16) {
+		v_int16x8 r[2];
+		for (int q = 0; q < 2; q++) {
+			v_int16x8 tb0, tb1;
+			v_zip(v_reinterpret_as_s16(v_load(h0 + k + 8 * q)), v_reinterpret_as_s16(v_load(h1 + k + 8 * q)), tb0, tb1);
+			r[q] = v_pack((v_dotprod(tb0, wy) + v_round) >> WARP_COEF_BITS, (v_dotprod(tb1, wy) + v_round) >> WARP_COEF_BITS);
+		}
+		v_store(out + k, v_pack_u(r[0], r[1]));
 	}
+	return k;
+}
 
-	const int min = 0, max = 255;
-	int value[max + 1] = { 0 };
-	double hist[max + 1];
-	int row = img.rows, col = img.cols;
+// 16 bytes of warp_box_cols per iteration, the two rows are added in 16-bit lanes
+static inline int warp_box_cols_simd(const uchar* r0, const uchar* r1, int* acc, int len, bool first) {
+	using namespace cv;
+	int k = 0;
+	for (; k <= len - 16; k += 16) {
+		v_uint16x8 a0, a1;
+		v_expand(v_load(r0 + k), a0, a1);
+		if (r1) {
+			v_uint16x8 b0, b1;
+			v_expand(v_load(r1 + k), b0, b1);
+			a0 += b0;
+			a1 += b1;
+		}
+		v_uint32x4 q[4];
+		v_expand(a0, q[0], q[1]);
+		v_expand(a1, q[2], q[3]);
+		for (int m = 0; m < 4; m++) {
+			v_int32x4 v = v_reinterpret_as_s32(q[m]);
+			if (!first) {
+				v += v_load(acc + k + 4 * m);
+			}
+			v_store(acc + k + 4 * m, v);
+		}
+	}
+	return k;
+}
 
-	// count the times each grey value occurs
-	for (int i = 0; i < row; i++) {
-		for (int j = 0; j < col; j++) {
-			value[img.at<uchar>(i, j)]++;
+// the pairwise column sums of warp_box_reduce, in place: pixel j of n gets pixels
+// 2j and 2j + 1; whole pixels are added as vectors, the lane after a 3-channel one
+// is overwritten by the next pixel, single channels are split by two zips
+template<int cn>
+static inline int warp_box_fold_simd(int* acc, int n) {
+	using namespace cv;
+	int j = 0;
+	if (cn == 1) {
+		for (; j <= n - 4; j += 4) {
+			v_int32x4 z0, z1, even, odd;
+			v_zip(v_load(acc + 2 * j), v_load(acc + 2 * j + 4), z0, z1);
+			v_zip(z0, z1, even, odd);
+			v_store(acc + j, even + odd);
 		}
 	}
+	else {
+		for (; j < n - (cn == 3); j++) {
+			v_store(acc + cn * j, v_load(acc + 2 * cn * j) + v_load(acc + (2 * j + 1) * cn));
+		}
+	}
+	return j;
+}
 
-	// calculate P(f) and C(f)
-	for (int i = 0; i <= max; i++) {
-		hist[i] = (double)value[i] / (row * col);
-		if (i > 0)
-			hist[i] += hist[i - 1];
+// 16 means of whole boxes of 2^bits pixels per iteration
+static inline int warp_box_mean_simd(const int* acc, uchar* dst, int len, int bits) {
+	using namespace cv;
+	const v_int32x4 v_half = v_setall_s32(1 << bits >> 1);
+	int k = 0;
+	for (; k <= len - 16; k += 16) {
+		v_int32x4 q[4];
+		for (int m = 0; m < 4; m++) {
+			q[m] = (v_load(acc + k + 4 * m) + v_half) >> bits;
+		}
+		v_store(dst + k, v_pack_u(v_pack(q[0], q[1]), v_pack(q[2], q[3])));
 	}
+	return k;
+}
+#endif
 
-	// calculate the mapping g function
-	for (int i = 0; i <= max; i++) {
-		value[i] = (int)((max - min) * hist[i] + min + 0.5);
+// warp n pixels of one destination row
+// the source coordinate starts at (X, Y) and advances by (DX, DY) per pixel,
+// the caller guarantees that the 2x2 neighbourhood of every pixel is inside src
+template<typename T, int cn>
+static void warp_bilinear_row(const cv::Mat& src, T* dst, int X, int Y, int DX, int DY, int n) {
+	const T* sdata = src.ptr<T>();
+	size_t sstep = src.step / sizeof(T);
+	// the vector gather uses 32-bit offsets
+	int j = (double)src.rows * sstep < (double)INT_MAX ? warp_bilinear_row_simd<cn>(sdata, sstep, dst, X, Y, DX, DY, n) : 0;
+
+	for (; j < n; j++) {
+		warp_bilinear_pixel<T, cn>(sdata, sstep, X + j * DX, Y + j * DY, dst + j * cn);
 	}
+}
+
+static inline int64 floor_div(int64 a, int64 b) {
+	int64 q = a / b;
+	return (q * b > a) ? q - 1 : q;
+}
 
-	// result
-	cv::Mat ret = cv::Mat(row, col, CV_8U);
-	for (int i = 0; i < row; i++) {
-		for (int j = 0; j < col; j++) {
-			ret.at<uchar>(i, j) = value[img.at<uchar>(i, j)];
+// narrow [j0, j1) down to the pixels with 0 <= P0 + j * D <= pmax
+static void clip_span(int64 P0, int64 D, int64 pmax, int& j0, int& j1) {
+	// nothing to clip when both ends are inside, which spares the divisions
+	// for most rows and for the short runs of warpPerspective
+	if (j0 < j1) {
+		int64 a = P0 + j0 * D, b = P0 + (j1 - 1) * D;
+		if (a >= 0 && a <= pmax && b >= 0 && b <= pmax) {
+			return;
 		}
 	}
+	int64 lo, hi;
+	if (D > 0) {
+		lo = -floor_div(P0, D);
+		hi = floor_div(pmax - P0, D) + 1;
+	}
+	else if (D < 0) {
+		lo = -floor_div(pmax - P0, -D);
+		hi = floor_div(P0, -D) + 1;
+	}
+	else {
+		lo = (P0 >= 0 && P0 <= pmax) ? j0 : j1;
+		hi = j1;
+	}
+	j0 = (int)std::max<int64>(j0, std::min<int64>(lo, j1));
+	j1 = (int)std::max<int64>(j0, std::min<int64>(hi, j1));
+}
 
-	return ret;
+// zero a row of n pixels outside of its valid span [j0, j1)
+template<typename T>
+static inline void warp_clear_outside(T* dst, int n, int j0, int j1, int cn) {
+	memset(dst, 0, (size_t)j0 * cn * sizeof(T));
+	memset(dst + (size_t)j1 * cn, 0, (size_t)(n - j1) * cn * sizeof(T));
+}
+
+// valid span [j0, j1) of a row of n pixels starting at (X0, Y0), i.e., the pixels
+// whose source coordinate is inside src
+static void warp_row_span(cv::Size src_size, int64 X0, int64 Y0, int DX, int DY, int n, int& j0, int& j1) {
+	j0 = 0;
+	j1 = n;
+	clip_span(X0, DX, (int64)(src_size.width - 1) << WARP_FIX_BITS, j0, j1);
+	clip_span(Y0, DY, (int64)(src_size.height - 1) << WARP_FIX_BITS, j0, j1);
+}
+
+// warp one destination row of n pixels whose valid span [j0, j1) is known
+// pixels outside of the span are set to zero
+template<typename T, int cn>
+static void warp_affine_span(const cv::Mat& src, T* dst, int64 X0, int64 Y0, int DX, int DY, int n, int j0, int j1) {
+	int64 xmax = (int64)(src.cols - 1) << WARP_FIX_BITS;
+	int64 ymax = (int64)(src.rows - 1) << WARP_FIX_BITS;
+
+	warp_clear_outside(dst, n, j0, j1, cn);
+
+	// samples on the last column or row of src have no right or lower neighbour,
+	// being extremes of a linear function they sit at the ends of the span
+	while (j0 < j1 && (X0 + (int64)j0 * DX == xmax || Y0 + (int64)j0 * DY == ymax)) {
+		warp_bilinear_pixel_edge<T, cn>(src, (int)(X0 + (int64)j0 * DX), (int)(Y0 + (int64)j0 * DY), dst + j0 * cn);
+		j0++;
+	}
+	while (j1 > j0 && (X0 + (int64)(j1 - 1) * DX == xmax || Y0 + (int64)(j1 - 1) * DY == ymax)) {
+		j1--;
+		warp_bilinear_pixel_edge<T, cn>(src, (int)(X0 + (int64)j1 * DX), (int)(Y0 + (int64)j1 * DY), dst + j1 * cn);
+	}
+
+	if (j0 < j1) {
+		warp_bilinear_row<T, cn>(src, dst + j0 * cn, (int)(X0 + (int64)j0 * DX), (int)(Y0 + (int64)j0 * DY), DX, DY, j1 - j0);
+	}
+}
+
+// warp one destination row, (X0, Y0) is the source coordinate of pixel 0
+// pixels mapped outside of src are set to zero, the valid span in between is
+// computed analytically so that the kernel never tests bounds
+template<typename T, int cn>
+static void warp_affine_row(const cv::Mat& src, T* dst, int64 X0, int64 Y0, int DX, int DY, int n) {
+	int j0, j1;
+	warp_row_span(src.size(), X0, Y0, DX, DY, n, j0, j1);
+	warp_affine_span<T, cn>(src, dst, X0, Y0, DX, DY, n, j0, j1);
+}
+
+// fixed-point dst -> src mapping of a whole dst image, the dst origin is folded into inv
+struct WarpAffineMap {
+	double inv[6];
+	int DX, DY;
+	// row 0 of the dst the kernels write is row row0 of the whole dst and row 0 of
+	// their src is row src_row0 of the whole src, both are 0 except for the strips
+	// of warpAffineStream, which then step exactly the coordinates of warpAffine
+	int row0 = 0, src_row0 = 0;
+
+	// 16.16 source coordinate of the first pixel of row i
+	void row_start(int i, int64& X, int64& Y) const {
+		X = warp_fix(inv[1] * (i + row0) + inv[2]);
+		Y = warp_fix(inv[4] * (i + row0) + inv[5]) - ((int64)src_row0 << WARP_FIX_BITS);
+	}
+};
+
+// the general path, rows [i0, i1) and columns [j0, j1) of dst
+template<typename T, int cn>
+static void warp_general(const cv::Mat& src, cv::Mat& dst, const WarpAffineMap& map, int i0, int i1, int j0, int j1) {
+	// affine transformation
+	// i is on y axis, j is on x axis
+	for (int i = i0; i < i1; i++) {
+		int64 X, Y;
+		map.row_start(i, X, Y);
+		X += (int64)j0 * map.DX;
+		Y += (int64)j0 * map.DY;
+		warp_affine_row<T, cn>(src, dst.ptr<T>(i) + j0 * cn, X, Y, map.DX, map.DY, j1 - j0);
+	}
+}
+
+// bicubic (a = -0.75 as in OpenCV) and Lanczos-3 kernels
+static double warp_cubic_kernel(double x) {
+	const double a = -0.75;
+	x = std::abs(x);
+	if (x < 1) {
+		return ((a + 2) * x - (a + 3)) * x * x + 1;
+	}
+	if (x < 2) {
+		return (((x - 5) * x + 8) * x - 4) * a;
+	}
+	return 0;
 }
 
-// convert rgb to hsi
-// rgb is assumed to be ranging from 0 to 255
-// return hsi that is normalized
-static cv::Mat rgb_to_hsi(const cv::Mat& rgb) {
-	int row = rgb.rows, col = rgb.cols;
-	cv::Mat hsi = cv::Mat(row, col, CV_64FC3);
+// exactly 1 and 0 at the integers, so that unfractional coordinates copy src,
+// which sin(pi * x) of double precision would not give for the float weights
+static double warp_lanczos3_kernel(double x) {
+	if (std::abs(x) < 1e-12) {
+		return 1;
+	}
+	if (std::abs(x) >= 3 || std::abs(x - std::floor(x + 0.5)) < 1e-12) {
+		return 0;
+	}
+	double px = M_PI * x;
+	return 3 * std::sin(px) * std::sin(px / 3) / (px * px);
+}
 
-	for (int i = 0; i < row; i++) {
-		for (int j = 0; j < col; j++) {
-			cv::Vec3d hsi_vec;
-			cv::Vec3b rgb_vec = rgb.at<cv::Vec3b>(i, j);
-			uchar min = std::min(std::min(rgb_vec[0], rgb_vec[1]), rgb_vec[2]);
-			int sum = rgb_vec[0] + rgb_vec[1] + rgb_vec[2];
-			int rg = rgb_vec[2] - rgb_vec[1], rb = rgb_vec[2] - rgb_vec[0], gb = rgb_vec[1] - rgb_vec[0];
+// weights of the N-tap kernels, bicubic for N = 4 and Lanczos-3 for N = 6, for
+// each of the WARP_INTER_SIZE phases; the taps of one phase are at -(N / 2 - 1) .. N / 2
+// and sum up to one, in fixed point for 8-bit images and in float for the others
+template<int N>
+struct WarpHiTable {
+	short coef[WARP_INTER_SIZE][N];
+	float fcoef[WARP_INTER_SIZE][N];
 
-			// calculate hsi value
-			if (rg == 0 && rb == 0) {
-				hsi_vec[0] = 0;
-				hsi_vec[1] = 0;
+	WarpHiTable() {
+		for (int f = 0; f < WARP_INTER_SIZE; f++) {
+			double w[N], sum = 0;
+			for (int k = 0; k < N; k++) {
+				double x = (double)f / WARP_INTER_SIZE - (k - (N / 2 - 1));
+				w[k] = N == 4 ? warp_cubic_kernel(x) : warp_lanczos3_kernel(x);
+				sum += w[k];
 			}
-			else {
-				hsi_vec[0] = acos((rg + rb) / (2 * sqrt(rg * rg + rb * gb)));
-				hsi_vec[0] = gb >= 0 ? hsi_vec[0] : 2 * M_PI - hsi_vec[0];
-				hsi_vec[1] = 1 - (double)(3 * min) / sum;
+			// the rounding error goes to the centre tap so that flat areas stay flat
+			int isum = 0, centre = N / 2 - 1 + (f >= WARP_INTER_SIZE / 2);
+			for (int k = 0; k < N; k++) {
+				fcoef[f][k] = (float)(w[k] / sum);
+				coef[f][k] = (short)std::floor(w[k] / sum * (1 << WARP_HI_BITS) + 0.5);
+				isum += coef[f][k];
+			}
+			coef[f][centre] += (short)((1 << WARP_HI_BITS) - isum);
+		}
+	}
+
+	const short* row(int f, short) const {
+		return coef[f];
+	}
+	const float* row(int f, float) const {
+		return fcoef[f];
+	}
+};
+
+template<int N>
+static const WarpHiTable<N>& warp_hi_table() {
+	static const WarpHiTable<N> table;
+	return table;
+}
+
+// N x N interpolation of one pixel from its top-left tap p, separable weights wx, wy
+template<typename T, int cn, int N>
+static inline void warp_hi_taps(const T* p, size_t sstep, const typename WarpDepth<T>::hi_coef_type* wx,
+	const typename WarpDepth<T>::hi_coef_type* wy, T* dst) {
+	typedef typename WarpDepth<T>::hi_work_type WT;
+	for (int c = 0; c < cn; c++) {
+		WT acc = 0;
+		for (int ky = 0; ky < N; ky++) {
+			const T* r = p + ky * sstep + c;
+			WT h = 0;
+			for (int kx = 0; kx < N; kx++) {
+				h += r[kx * cn] * wx[kx];
 			}
-			hsi_vec[2] = (double)sum / (3 * 255);
+			acc += h * wy[ky];
+		}
+		dst[c] = WarpDepth<T>::round_hi(acc);
+	}
+}
 
-			//std::cout << rg << " " << rb << " " << gb << " " << hsi_vec[0] << std::endl;
-			hsi.at<cv::Vec3d>(i, j) = hsi_vec;
+// N x N interpolation of one pixel near the border of src, taps outside of src
+// are replaced by the nearest border pixel
+template<typename T, int cn, int N>
+static void warp_hi_pixel_edge(const cv::Mat& src, int X, int Y, T* dst) {
+	typedef typename WarpDepth<T>::hi_coef_type CT;
+	typedef typename WarpDepth<T>::hi_work_type WT;
+	const WarpHiTable<N>& table = warp_hi_table<N>();
+	const CT* wx = table.row((X >> WARP_FRAC_SHIFT) & (WARP_INTER_SIZE - 1), CT());
+	const CT* wy = table.row((Y >> WARP_FRAC_SHIFT) & (WARP_INTER_SIZE - 1), CT());
+	int sx = (X >> WARP_FIX_BITS) - (N / 2 - 1), sy = (Y >> WARP_FIX_BITS) - (N / 2 - 1);
+	const T* rows[N];
+	int xofs[N];
+	for (int k = 0; k < N; k++) {
+		rows[k] = src.ptr<T>(std::min(std::max(sy + k, 0), src.rows - 1));
+		xofs[k] = std::min(std::max(sx + k, 0), src.cols - 1) * cn;
+	}
+
+	for (int c = 0; c < cn; c++) {
+		WT acc = 0;
+		for (int ky = 0; ky < N; ky++) {
+			WT h = 0;
+			for (int kx = 0; kx < N; kx++) {
+				h += rows[ky][xofs[kx] + c] * wx[kx];
+			}
+			acc += h * wy[ky];
 		}
+		dst[c] = WarpDepth<T>::round_hi(acc);
 	}
+}
 
-	return hsi;
+// vectorized part of warp_hi_interior, see warp_bilinear_row_simd
+template<int cn, int N, typename T>
+static inline int warp_hi_row_simd(const T*, size_t, T*, int, int, int, int, int) {
+	return 0;
 }
 
-// convert hsi to rgb
-// hsi is assumed to be normalized
-// return rgb that ranges from 0 to 255
-static cv::Mat hsi_to_rgb(const cv::Mat& hsi) {
-	int row = hsi.rows, col = hsi.cols;
-	cv::Mat rgb = cv::Mat::zeros(row, col, CV_8UC3);
+#if CV_SIMD128 && !defined(IPLIB_DISABLE_SIMD)
+// N x N interpolation of 16 pixels whose top-left taps are at sdata + ofs[k],
+// wx[t][k] and wy[t][k] are the weights of tap t of pixel k
+// the taps are gathered into planar buffers, pairs of horizontal taps are
+// multiplied and added in one step, the arithmetic is exactly the one of warp_hi_taps
+template<int cn, int N>
+static inline void warp_hi_block(const uchar* sdata, size_t sstep, const int* ofs, const short (*wx)[16], const short (*wy)[16], uchar* dst) {
+	using namespace cv;
+	uchar CV_DECL_ALIGNED(16) taps[N][N][cn][16];
+	for (int k = 0; k < 16; k++) {
+		const uchar* p = sdata + ofs[k];
+		for (int ky = 0; ky < N; ky++, p += sstep) {
+			for (int kx = 0; kx < N; kx++) {
+				for (int c = 0; c < cn; c++) {
+					taps[ky][kx][c][k] = p[kx * cn + c];
+				}
+			}
+		}
+	}
 
-	for (int i = 0; i < row; i++) {
-		for (int j = 0; j < col; j++) {
-			double H = hsi.at<cv::Vec3d>(i, j)[0], S = hsi.at<cv::Vec3d>(i, j)[1], I = hsi.at<cv::Vec3d>(i, j)[2];
-			double r, g, b;
+	// weights of the horizontal tap pairs, interleaved like the taps below
+	v_int16x8 wxz[N / 2][4];
+	for (int kx = 0; kx < N; kx += 2) {
+		v_zip(v_load_aligned(wx[kx]), v_load_aligned(wx[kx + 1]), wxz[kx / 2][0], wxz[kx / 2][1]);
+		v_zip(v_load_aligned(wx[kx] + 8), v_load_aligned(wx[kx + 1] + 8), wxz[kx / 2][2], wxz[kx / 2][3]);
+	}
+	const v_int32x4 v_round = v_setall_s32(1 << (2 * WARP_HI_BITS - 1));
 
-			if (H >= 0 && H < 2 * M_PI / 3) {
-				b = (1 - S) / 3;
-				r = (1 + S * cos(H) / cos(M_PI / 3 - H)) / 3;
-				g = 1 - r - b;
+	v_uint8x16 res[cn];
+	for (int c = 0; c < cn; c++) {
+		v_int32x4 acc[4] = { v_setzero_s32(), v_setzero_s32(), v_setzero_s32(), v_setzero_s32() };
+		for (int ky = 0; ky < N; ky++) {
+			v_int32x4 h[4] = { v_setzero_s32(), v_setzero_s32(), v_setzero_s32(), v_setzero_s32() };
+			for (int kx = 0; kx < N; kx += 2) {
+				v_uint16x8 a[2], b[2];
+				v_expand(v_load_aligned(taps[ky][kx][c]), a[0], a[1]);
+				v_expand(v_load_aligned(taps[ky][kx + 1][c]), b[0], b[1]);
+				for (int q = 0; q < 2; q++) {
+					v_int16x8 z0, z1;
+					v_zip(v_reinterpret_as_s16(a[q]), v_reinterpret_as_s16(b[q]), z0, z1);
+					h[2 * q] += v_dotprod(z0, wxz[kx / 2][2 * q]);
+					h[2 * q + 1] += v_dotprod(z1, wxz[kx / 2][2 * q + 1]);
+				}
 			}
-			else if (H >= 2 * M_PI / 3 && H < 4 * M_PI / 3) {
-				H -= 2 * M_PI / 3;
-				r = (1 - S) / 3;
-				g = (1 + S * cos(H) / cos(M_PI / 3 - H)) / 3;
-				b = 1 - r - g;
+			v_int32x4 w[4];
+			v_expand(v_load_aligned(wy[ky]), w[0], w[1]);
+			v_expand(v_load_aligned(wy[ky] + 8), w[2], w[3]);
+			for (int q = 0; q < 4; q++) {
+				acc[q] += h[q] * w[q];
 			}
-			else if (H >= 4 * M_PI / 3 && H <= 2 * M_PI) {
-				H -= 4 * M_PI / 3;
-				g = (1 - S) / 3;
-				b = (1 + S * cos(H) / cos(M_PI / 3 - H)) / 3;
-				r = 1 - g - b;
+		}
+		for (int q = 0; q < 4; q++) {
+			acc[q] = (acc[q] + v_round) >> (2 * WARP_HI_BITS);
+		}
+		res[c] = v_pack_u(v_pack(acc[0], acc[1]), v_pack(acc[2], acc[3]));
+	}
+
+	warp_store_pixels<cn>(dst, res);
+}
+
+// 16 pixels of warp_hi_interior per iteration
+template<int cn, int N>
+static inline int warp_hi_row_simd(const uchar* sdata, size_t sstep, uchar* dst, int X, int Y, int DX, int DY, int n) {
+	const WarpHiTable<N>& table = warp_hi_table<N>();
+	int ofs[16];
+	short CV_DECL_ALIGNED(16) wx[N][16];
+	short CV_DECL_ALIGNED(16) wy[N][16];
+	int j = 0;
+	for (; j <= n - 16; j += 16) {
+		for (int k = 0; k < 16; k++) {
+			int x = X + (j + k) * DX, y = Y + (j + k) * DY;
+			ofs[k] = ((y >> WARP_FIX_BITS) - (N / 2 - 1)) * (int)sstep + ((x >> WARP_FIX_BITS) - (N / 2 - 1)) * cn;
+			const short* cx = table.coef[(x >> WARP_FRAC_SHIFT) & (WARP_INTER_SIZE - 1)];
+			const short* cy = table.coef[(y >> WARP_FRAC_SHIFT) & (WARP_INTER_SIZE - 1)];
+			for (int t = 0; t < N; t++) {
+				wx[t][k] = cx[t];
+				wy[t][k] = cy[t];
 			}
-			else {
-				std::cout << "out of range, H = " << H << std::endl;
-				continue;
+		}
+		warp_hi_block<cn, N>(sdata, sstep, ofs, wx, wy, dst + j * cn);
+	}
+	return j;
+}
+#endif
+
+// N x N interpolation of n pixels of one destination row, the caller guarantees
+// that all N x N taps of every pixel are inside src
+template<typename T, int cn, int N>
+static void warp_hi_interior(const cv::Mat& src, T* dst, int X, int Y, int DX, int DY, int n) {
+	typedef typename WarpDepth<T>::hi_coef_type CT;
+	const WarpHiTable<N>& table = warp_hi_table<N>();
+	const T* sdata = src.ptr<T>();
+	size_t sstep = src.step / sizeof(T);
+	// the vector gather uses 32-bit offsets
+	int j = (double)src.rows * sstep < (double)INT_MAX ? warp_hi_row_simd<cn, N>(sdata, sstep, dst, X, Y, DX, DY, n) : 0;
+
+	for (; j < n; j++) {
+		int x = X + j * DX, y = Y + j * DY;
+		const T* p = sdata + (size_t)((y >> WARP_FIX_BITS) - (N / 2 - 1)) * sstep + ((x >> WARP_FIX_BITS) - (N / 2 - 1)) * cn;
+		warp_hi_taps<T, cn, N>(p, sstep, table.row((x >> WARP_FRAC_SHIFT) & (WARP_INTER_SIZE - 1), CT()),
+			table.row((y >> WARP_FRAC_SHIFT) & (WARP_INTER_SIZE - 1), CT()), dst + j * cn);
+	}
+}
+
+// warp one destination row with an N-tap kernel, the valid span is the one of
+// the bilinear path and only the pixels whose taps cross the border of src
+// take the slow path
+template<typename T, int cn, int N>
+static void warp_hi_row(const cv::Mat& src, T* dst, int64 X0, int64 Y0, int DX, int DY, int n) {
+	int j0, j1;
+	warp_row_span(src.size(), X0, Y0, DX, DY, n, j0, j1);
+	warp_clear_outside(dst, n, j0, j1, cn);
+
+	// interior: N / 2 - 1 taps before and N / 2 taps after the pixel are inside src,
+	// empty when src is narrower than the kernel
+	const int64 one = 1 << WARP_FIX_BITS, lo = (N / 2 - 1) * one;
+	int k0 = j0, k1 = j1;
+	clip_span(X0 - lo, DX, (src.cols - N / 2) * one - 1 - lo, k0, k1);
+	clip_span(Y0 - lo, DY, (src.rows - N / 2) * one - 1 - lo, k0, k1);
+
+	for (int j = j0; j < k0; j++) {
+		warp_hi_pixel_edge<T, cn, N>(src, (int)(X0 + (int64)j * DX), (int)(Y0 + (int64)j * DY), dst + j * cn);
+	}
+	for (int j = k1; j < j1; j++) {
+		warp_hi_pixel_edge<T, cn, N>(src, (int)(X0 + (int64)j * DX), (int)(Y0 + (int64)j * DY), dst + j * cn);
+	}
+	if (k0 < k1) {
+		warp_hi_interior<T, cn, N>(src, dst + k0 * cn, (int)(X0 + (int64)k0 * DX), (int)(Y0 + (int64)k0 * DY), DX, DY, k1 - k0);
+	}
+}
+
+// the general path with an N-tap kernel, rows [i0, i1) and columns [j0, j1) of dst
+template<typename T, int cn, int N>
+static void warp_general_hi(const cv::Mat& src, cv::Mat& dst, const WarpAffineMap& map, int i0, int i1, int j0, int j1) {
+	for (int i = i0; i < i1; i++) {
+		int64 X, Y;
+		map.row_start(i, X, Y);
+		X += (int64)j0 * map.DX;
+		Y += (int64)j0 * map.DY;
+		warp_hi_row<T, cn, N>(src, dst.ptr<T>(i) + j0 * cn, X, Y, map.DX, map.DY, j1 - j0);
+	}
+}
+
+// nearest neighbour of one row of n pixels starting at (X0, Y0)
+// inside the valid span every pixel is copied from the src pixel its coordinate
+// rounds to, without any test, which keeps label and mask values intact
+template<typename T, int cn>
+static void warp_nearest_row(const cv::Mat& src, T* dst, int64 X0, int64 Y0, int DX, int DY, int n) {
+	const T* sdata = src.ptr<T>();
+	size_t sstep = src.step / sizeof(T);
+	const int half = 1 << (WARP_FIX_BITS - 1);
+	int s0, s1;
+	warp_row_span(src.size(), X0, Y0, DX, DY, n, s0, s1);
+	warp_clear_outside(dst, n, s0, s1, cn);
+
+	// X <= (cols - 1) << 16 inside the span, so X + half does not overflow
+	int x = (int)(X0 + (int64)s0 * DX) + half, y = (int)(Y0 + (int64)s0 * DY) + half;
+	for (int j = s0, k = 0; j < s1; j++, k++) {
+		const T* p = sdata + (size_t)((y + k * DY) >> WARP_FIX_BITS) * sstep + ((x + k * DX) >> WARP_FIX_BITS) * cn;
+		for (int c = 0; c < cn; c++) {
+			dst[j * cn + c] = p[c];
+		}
+	}
+}
+
+// the general path with nearest neighbour, rows [i0, i1) and columns [j0, j1) of dst
+template<typename T, int cn>
+static void warp_nearest(const cv::Mat& src, cv::Mat& dst, const WarpAffineMap& map, int i0, int i1, int j0, int j1) {
+	for (int i = i0; i < i1; i++) {
+		int64 X, Y;
+		map.row_start(i, X, Y);
+		X += (int64)j0 * map.DX;
+		Y += (int64)j0 * map.DY;
+		warp_nearest_row<T, cn>(src, dst.ptr<T>(i) + j0 * cn, X, Y, map.DX, map.DY, j1 - j0);
+	}
+}
+
+// dst -> src homography of a whole dst image, the dst origin is folded into inv
+struct WarpPerspectiveMap {
+	double inv[9];
+};
+
+// runs of a perspective row are at most this long, and their linear stepping is
+// off from the exact coordinates by less than half an interpolation phase
+const int WARP_PERSPECTIVE_RUN = 64;
+const double WARP_PERSPECTIVE_EPS = 0.5 / WARP_INTER_SIZE;
+
+// 16.16 src coordinate num * rw, rw = 1 / w, or far outside of src if it is not finite
+static inline int64 warp_perspective_fix(double num, double rw) {
+	const double lim = 1 << (31 - WARP_FIX_BITS);
+	double v = num * rw;
+	return warp_fix(v > -lim && v < lim ? v : -lim);
+}
+
+// the perspective path, rows [i0, i1) and columns [j0, j1) of dst, row is the row
+// kernel of an interpolation
+// along a row the numerators and the denominator are linear, x(t) = (a + b t) / (c + g t),
+// and the chord of x over a run of L pixels is off by at most L^2 |g (b c - a g)| / (4 |w|^3),
+// |w| the smallest denominator of the run; so every row is cut into runs for which
+// that stays below WARP_PERSPECTIVE_EPS, and each run is stepped like an affine row
+// from the exact coordinates of its first pixel to those of the next run's
+template<typename T, int cn, void (*row)(const cv::Mat&, T*, int64, int64, int, int, int)>
+static void warp_perspective(const cv::Mat& src, cv::Mat& dst, const WarpPerspectiveMap& map, int i0, int i1, int j0, int j1) {
+	const double* h = map.inv;
+	int n = j1 - j0;
+
+	for (int i = i0; i < i1; i++) {
+		T* d = dst.ptr<T>(i) + j0 * cn;
+		double ax = h[0] * j0 + h[1] * i + h[2], ay = h[3] * j0 + h[4] * i + h[5], c = h[6] * j0 + h[7] * i + h[8];
+		double bx = h[0], by = h[3], g = h[6];
+		double k = std::abs(g) * std::max(std::abs(bx * c - ax * g), std::abs(by * c - ay * g)) / (4 * WARP_PERSPECTIVE_EPS);
+
+		double w = c, rw = 1 / w;
+		int64 X = warp_perspective_fix(ax, rw), Y = warp_perspective_fix(ay, rw);
+		for (int j = 0; j < n;) {
+			int L = std::min(WARP_PERSPECTIVE_RUN, n - j);
+			double we = c + g * (j + L);
+			if (k > 0) {
+				double wmin = w * we > 0 ? std::min(std::abs(w), std::abs(we)) : 0, w3 = wmin * wmin * wmin;
+				if ((double)L * L * k > w3) {
+					L = std::max(std::min(L, (int)std::sqrt(w3 / k)), 1);
+					we = c + g * (j + L);
+				}
 			}
+			double rwe = 1 / we;
+			int64 XE = warp_perspective_fix(ax + bx * (j + L), rwe), YE = warp_perspective_fix(ay + by * (j + L), rwe);
 
-			rgb.at<cv::Vec3b>(i, j)[0] = (uchar)(3 * I * b * 255);
-			rgb.at<cv::Vec3b>(i, j)[1] = (uchar)(3 * I * g * 255);
-			rgb.at<cv::Vec3b>(i, j)[2] = (uchar)(3 * I * r * 255);
+			// single pixels and runs that come from too far away take no step
+			int64 DX = (XE - X) / L, DY = (YE - Y) / L;
+			if (L == 1 || std::abs(DX) >= (1 << 30) || std::abs(DY) >= (1 << 30)) {
+				L = 1;
+				DX = DY = 0;
+				we = c + g * (j + 1);
+				rwe = 1 / we;
+				XE = warp_perspective_fix(ax + bx * (j + 1), rwe);
+				YE = warp_perspective_fix(ay + by * (j + 1), rwe);
+			}
+			row(src, d + j * cn, X, Y, (int)DX, (int)DY, L);
+			j += L;
+			X = XE;
+			Y = YE;
+			w = we;
 		}
 	}
+}
 
-	return rgb;
+// round a 16.16 coordinate to the nearest pixel
+static inline int64 warp_round(int64 X) {
+	return (X + (1 << (WARP_FIX_BITS - 1))) >> WARP_FIX_BITS;
 }
 
+// dst[k] = src[n - 1 - k] for n pixels
+template<typename T, int cn>
+static void warp_reverse_row(const T* src, T* dst, int n) {
+	int k = warp_reverse_row_simd<cn>(src, dst, n);
+	for (; k < n; k++) {
+		for (int c = 0; c < cn; c++) {
+			dst[k * cn + c] = src[(n - 1 - k) * cn + c];
+		}
+	}
+}
 
-// histogram equalization for color image
-// algorithm: rgb->hsi->rgb
-// only support CV_8U depth now, i.e., 0..255
-cv::Mat histogram_equalization_color_hsi(const cv::Mat& img) {
-	if (img.type() != CV_8UC3) {
-		std::cout << "histogram_equalization_color_hsi: img's not CV_8UC3\n";
-		return img;
+// identity, integer translation and axis mirrors: every dst row is a
+// plain or reversed copy of a piece of one src row
+template<typename T, int cn>
+static void warp_copy(const cv::Mat& src, cv::Mat& dst, const WarpAffineMap& map, int i0, int i1) {
+	int sdx = map.DX > 0 ? 1 : -1;
+	int n = dst.cols;
+
+	for (int i = i0; i < i1; i++) {
+		T* d = dst.ptr<T>(i);
+		int64 X, Y;
+		map.row_start(i, X, Y);
+		int64 sx0 = warp_round(X), sy = warp_round(Y);
+		int j0 = 0, j1 = n;
+		clip_span(sy, 0, src.rows - 1, j0, j1);
+		clip_span(sx0, sdx, src.cols - 1, j0, j1);
+		warp_clear_outside(d, n, j0, j1, cn);
+		if (j0 == j1) {
+			continue;
+		}
+
+		const T* s = src.ptr<T>((int)sy);
+		if (sdx > 0) {
+			memcpy(d + j0 * cn, s + (sx0 + j0) * cn, (size_t)(j1 - j0) * cn * sizeof(T));
+		}
+		else {
+			warp_reverse_row<T, cn>(s + (sx0 - (j1 - 1)) * cn, d + j0 * cn, j1 - j0);
+		}
 	}
+}
 
-	// rgb to hsi
-	cv::Mat hsi = rgb_to_hsi(img);
+// multiples of 90 degrees: every dst row is a src column, walked tile by tile
+// so that the src rows touched by one tile stay in cache
+template<typename T, int cn>
+static void warp_transpose(const cv::Mat& src, cv::Mat& dst, const WarpAffineMap& map, int i0, int i1) {
+	const int TILE = 32;
+	int sdy = map.DY > 0 ? 1 : -1;
+	int n = dst.cols;
+	size_t sstep = src.step / sizeof(T);
+	int64 sx[TILE], sy0[TILE];
+	int j0[TILE], j1[TILE];
 
-	// histogram equalization for I channel
-	cv::Mat hsi_channels[3], i_chan;
-	cv::Mat hist[3], hist_out;
-	cv::split(hsi, hsi_channels);
-	hsi_channels[2] *= 255;
-	hsi_channels[2].convertTo(i_chan, CV_8U);
-	hist[0] = cal_hist_grey(i_chan);
-	i_chan = histogram_equalization_grey(i_chan);
-	hist[2] = cal_hist_grey(i_chan);
-	i_chan.convertTo(hsi_channels[2], CV_64F);
-	hsi_channels[2] *= 1.0 / 255;
-	cv::merge(hsi_channels, 3, hsi);
-
-	// plot histogram before and after transformation
-	hist[1] = cv::Mat(hist_height, 10, CV_8UC3, cv::Scalar(144, 238, 144));
-	cv::hconcat(hist, 3, hist_out);
-	cv::imshow("hist out", hist_out);
+	for (int ib = i0; ib < i1; ib += TILE) {
+		int ie = std::min(ib + TILE, i1);
+		for (int i = ib; i < ie; i++) {
+			int64 X, Y;
+			map.row_start(i, X, Y);
+			int t = i - ib;
+			sx[t] = warp_round(X);
+			sy0[t] = warp_round(Y);
+			j0[t] = 0;
+			j1[t] = n;
+			clip_span(sx[t], 0, src.cols - 1, j0[t], j1[t]);
+			clip_span(sy0[t], sdy, src.rows - 1, j0[t], j1[t]);
+			warp_clear_outside(dst.ptr<T>(i), n, j0[t], j1[t], cn);
+		}
 
-	// hsi to rgb
-	cv::Mat rgb = hsi_to_rgb(hsi);
+		for (int jb = 0; jb < n; jb += TILE) {
+			for (int i = ib; i < ie; i++) {
+				int t = i - ib;
+				int js = std::max(jb, j0[t]), je = std::min(jb + TILE, j1[t]);
+				T* d = dst.ptr<T>(i) + js * cn;
+				const T* s = src.ptr<T>() + (sy0[t] + (int64)sdy * js) * sstep + sx[t] * cn;
+				ptrdiff_t ds = sdy * (ptrdiff_t)sstep;
+				for (int j = js; j < je; j++, d += cn, s += ds) {
+					for (int c = 0; c < cn; c++) {
+						d[c] = s[c];
+					}
+				}
+			}
+		}
+	}
+}
 
-	return rgb;
+// axis-aligned scaling, separable: every needed src row is blended horizontally
+// once with a per-column table, then pairs of those rows are blended vertically
+// the weights and rounding are the ones of the general path
+//
+// which dst pixels are valid is decided by span_map on a src of span_size, which
+// differ from map and src when src is a box reduced copy of the original image;
+// coordinates are then clamped to the reduced image
+template<typename T, int cn>
+static void warp_scale_reduced(const cv::Mat& src, cv::Mat& dst, const WarpAffineMap& map, int i0, int i1,
+	cv::Size span_size, const WarpAffineMap& span_map) {
+	typedef typename WarpDepth<T>::row_type RT;
+	int n = dst.cols;
+	int64 xmax = (int64)(src.cols - 1) << WARP_FIX_BITS;
+	int64 ymax = (int64)(src.rows - 1) << WARP_FIX_BITS;
+	int64 X0, Y0, SX0, SY0;
+	map.row_start(i0, X0, Y0);
+	span_map.row_start(i0, SX0, SY0);
+
+	// per-column table: offsets of both taps and the weight of the second one
+	int j0 = 0, j1 = n;
+	clip_span(SX0, span_map.DX, (int64)(span_size.width - 1) << WARP_FIX_BITS, j0, j1);
+	int m = j1 - j0;
+	std::vector<int> xofs(2 * m);
+	std::vector<ushort> xw(m);
+	for (int k = 0; k < m; k++) {
+		int X = (int)std::min(std::max(X0 + (int64)(j0 + k) * map.DX, (int64)0), xmax);
+		int sx = X >> WARP_FIX_BITS;
+		xofs[2 * k] = sx * cn;
+		xofs[2 * k + 1] = std::min(sx + 1, src.cols - 1) * cn;
+		xw[k] = (ushort)((X >> WARP_FRAC_SHIFT) & (WARP_INTER_SIZE - 1));
+	}
+
+	// horizontally blended src rows, two slots are enough since dst rows walk src monotonically
+	std::vector<RT> hbuf(2 * (size_t)std::max(m, 1) * cn);
+	RT* hrow[2] = { &hbuf[0], &hbuf[(size_t)std::max(m, 1) * cn] };
+	int hsy[2] = { -1, -1 };
+
+	for (int i = i0; i < i1; i++) {
+		T* d = dst.ptr<T>(i);
+		int64 X, Y;
+		span_map.row_start(i, X, Y);
+		if (Y < 0 || Y > ((int64)(span_size.height - 1) << WARP_FIX_BITS) || m == 0) {
+			memset(d, 0, (size_t)n * cn * sizeof(T));
+			continue;
+		}
+		warp_clear_outside(d, n, j0, j1, cn);
+		map.row_start(i, X, Y);
+		Y = std::min(std::max(Y, (int64)0), ymax);
+
+		int sy[2] = { (int)(Y >> WARP_FIX_BITS), std::min((int)(Y >> WARP_FIX_BITS) + 1, src.rows - 1) };
+		int fy = (int)((Y >> WARP_FRAC_SHIFT) & (WARP_INTER_SIZE - 1));
+		for (int t = 0; t < 2; t++) {
+			if (hsy[0] == sy[t] || hsy[1] == sy[t]) {
+				continue;
+			}
+			// evict the slot the other tap does not need
+			int slot = hsy[0] == sy[1 - t] ? 1 : 0;
+			const T* s = src.ptr<T>(sy[t]);
+			RT* hr = hrow[slot];
+			for (int k = 0; k < m; k++) {
+				const T* p0 = s + xofs[2 * k];
+				const T* p1 = s + xofs[2 * k + 1];
+				int fx = xw[k];
+				for (int c = 0; c < cn; c++) {
+					hr[k * cn + c] = (RT)(p0[c] * (WARP_INTER_SIZE - fx) + p1[c] * fx);
+				}
+			}
+			hsy[slot] = sy[t];
+		}
+		const RT* h[2] = { hrow[hsy[0] == sy[0] ? 0 : 1], hrow[hsy[0] == sy[1] ? 0 : 1] };
+
+		T* out = d + j0 * cn;
+		int len = m * cn;
+		int k = warp_scale_vert_simd(h[0], h[1], fy, out, len);
+		for (; k < len; k++) {
+			out[k] = WarpDepth<T>::round(h[0][k] * (WARP_INTER_SIZE - fy) + h[1][k] * fy);
+		}
+	}
+}
+
+template<typename T, int cn>
+static void warp_scale(const cv::Mat& src, cv::Mat& dst, const WarpAffineMap& map, int i0, int i1) {
+	warp_scale_reduced<T, cn>(src, dst, map, i0, i1, src.size(), map);
+}
+
+// len column sums of the box reduction: acc gets r0 + r1 if first, otherwise they
+// are added to it; r1 is nullptr when a box has an odd row left
+template<typename T>
+static void warp_box_cols(const T* r0, const T* r1, typename WarpDepth<T>::box_type* acc, int len, bool first) {
+	typedef typename WarpDepth<T>::box_type BT;
+	int k = warp_box_cols_simd(r0, r1, acc, len, first);
+	for (; k < len; k++) {
+		BT v = (BT)r0[k] + (r1 ? (BT)r1[k] : 0);
+		acc[k] = first ? v : acc[k] + v;
+	}
+}
+
+// the box reduction of src by 2^lx x 2^ly in a single pass, rows [i0, i1) of dst:
+// dst pixel (i, j) is the mean of the box of src at (i << ly, j << lx), boxes cut
+// by the last row or column average the pixels they have
+// the rows of a box are summed as columns first, which are then added pairwise lx
+// times in place
+template<typename T, int cn>
+static void warp_box_reduce(const cv::Mat& src, cv::Mat& dst, int lx, int ly, int i0, int i1) {
+	typedef typename WarpDepth<T>::box_type BT;
+	std::vector<BT> buf(src.cols * cn);
+	BT* acc = buf.data();
+	for (int i = i0; i < i1; i++) {
+		int y0 = i << ly, y1 = std::min(y0 + (1 << ly), src.rows);
+		for (int y = y0; y < y1; y += 2) {
+			warp_box_cols(src.ptr<T>(y), y + 1 < y1 ? src.ptr<T>(y + 1) : (const T*)nullptr, acc, src.cols * cn, y == y0);
+		}
+		for (int l = 0, w = src.cols; l < lx; l++, w = (w + 1) >> 1) {
+			int j = warp_box_fold_simd<cn>(acc, w >> 1);
+			for (; j < w >> 1; j++) {
+				for (int c = 0; c < cn; c++) {
+					acc[j * cn + c] = acc[2 * j * cn + c] + acc[(2 * j + 1) * cn + c];
+				}
+			}
+			if (w & 1) {
+				for (int c = 0; c < cn; c++) {
+					acc[j * cn + c] = acc[2 * j * cn + c];
+				}
+			}
+		}
+		T* d = dst.ptr<T>(i);
+		int full = y1 - y0 == 1 << ly ? src.cols >> lx : 0;
+		for (int k = warp_box_mean_simd(acc, d, full * cn, lx + ly); k < full * cn; k++) {
+			d[k] = WarpDepth<T>::box(acc[k], lx + ly);
+		}
+		for (int j = full; j < dst.cols; j++) {
+			int n = (std::min((j + 1) << lx, src.cols) - (j << lx)) * (y1 - y0);
+			for (int c = 0; c < cn; c++) {
+				d[j * cn + c] = WarpDepth<T>::mean(acc[j * cn + c], n);
+			}
+		}
+	}
+}
+
+enum WarpKind {
+	WARP_IDENTITY,
+	WARP_TRANSLATE,
+	WARP_MIRROR,
+	WARP_ROTATE90,
+	WARP_SCALE,
+	WARP_GENERAL
+};
+
+// classify the dst -> src mapping so that warpAffine can pick a dedicated kernel
+// 180 degrees is a mirror of both axes, 90 and 270 degrees are WARP_ROTATE90
+static WarpKind classify_affine(const double inv[6]) {
+	const double eps = 1e-9;
+	bool int_ofs = std::abs(inv[2] - std::floor(inv[2] + 0.5)) < eps && std::abs(inv[5] - std::floor(inv[5] + 0.5)) < eps;
+
+	if (std::abs(inv[1]) < eps && std::abs(inv[3]) < eps) {
+		bool unit_x = std::abs(std::abs(inv[0]) - 1) < eps, unit_y = std::abs(std::abs(inv[4]) - 1) < eps;
+		if (!unit_x || !unit_y || !int_ofs) {
+			return WARP_SCALE;
+		}
+		if (inv[0] < 0 || inv[4] < 0) {
+			return WARP_MIRROR;
+		}
+		return std::abs(inv[2]) < eps && std::abs(inv[5]) < eps ? WARP_IDENTITY : WARP_TRANSLATE;
+	}
+
+	if (std::abs(inv[0]) < eps && std::abs(inv[4]) < eps && int_ofs
+		&& std::abs(std::abs(inv[1]) - 1) < eps && std::abs(std::abs(inv[3]) - 1) < eps) {
+		return WARP_ROTATE90;
+	}
+
+	return WARP_GENERAL;
+}
+
+// src bytes touched by a tile_rows x tile_cols tile of dst, esz bytes per pixel: the tile maps to a
+// parallelogram in src, counted as its bounding box in whole cache lines
+static double warp_tile_footprint(const WarpAffineMap& map, int esz, int tile_rows, int tile_cols, double& src_rows) {
+	const double line = 64;
+	src_rows = std::abs(map.inv[3]) * tile_cols + std::abs(map.inv[4]) * tile_rows + 2;
+	double src_cols = std::abs(map.inv[0]) * tile_cols + std::abs(map.inv[1]) * tile_rows + 2;
+	return src_rows * (std::ceil(src_cols * esz / line) + 1) * line;
+}
+
+// pick the largest dst tile whose src footprint stays within half of a typical
+// 256K L2 and touches few enough src rows (each one its own page on wide images)
+// for the second level TLB, wider tiles win ties since dst is written by rows
+static void warp_tile_size(const WarpAffineMap& map, int esz, int& tile_rows, int& tile_cols) {
+	const double cache_bytes = 128 << 10;
+	const double max_src_rows = 256;
+	tile_rows = 8;
+	tile_cols = 32;
+	for (int w = 32; w <= 4096; w *= 2) {
+		for (int h = 8; h <= 1024; h *= 2) {
+			double src_rows;
+			double bytes = warp_tile_footprint(map, esz, h, w, src_rows);
+			if (bytes <= cache_bytes && src_rows <= max_src_rows && w * h >= tile_rows * tile_cols) {
+				tile_rows = h;
+				tile_cols = w;
+			}
+		}
+	}
+}
+
+// walk the dst of a general warp in rows or L2 sized tiles as opts says,
+// body(i0, i1, j0, j1) is called once per band or tile
+template<class Body>
+static void warp_traverse(const WarpAffineMap& map, int esz, cv::Size size, const WarpOptions& opts, const Body& body) {
+	// rotated rows walk src diagonally, a dst row then touches hundreds of src
+	// rows and tiles keep the src footprint of one task cache resident
+	int traversal = opts.traversal;
+	if (traversal == WARP_TRAVERSE_AUTO) {
+		double src_rows;
+		warp_tile_footprint(map, esz, 1, size.width, src_rows);
+		traversal = src_rows > 16 ? WARP_TRAVERSE_TILES : WARP_TRAVERSE_ROWS;
+	}
+
+	if (traversal == WARP_TRAVERSE_ROWS) {
+		parallel_for_rows(0, size.height, size.width, [&](int i0, int i1) {
+			body(i0, i1, 0, size.width);
+		}, opts);
+	}
+	else {
+		int tile_rows = opts.tile_rows, tile_cols = opts.tile_cols;
+		if (tile_rows <= 0 || tile_cols <= 0) {
+			warp_tile_size(map, esz, tile_rows, tile_cols);
+		}
+		ParallelOptions popts = opts;
+		popts.grain = tile_rows;
+		parallel_for_tiles(size.height, size.width, tile_rows, tile_cols, body, popts);
+	}
+}
+
+// check src_size and M, then fill in the dst -> src mapping and the dst size
+// shared by warpAffine and PreparedWarp, see warpAffine for the dsize semantics
+static bool warp_prepare(cv::Size src_size, const cv::Mat& M, cv::Size dsize, WarpAffineMap& map, cv::Size& size) {
+	const double eps = 1e-6;
+	int row = src_size.height;
+	int col = src_size.width;
+
+	if (row <= 0 || col <= 0 || row > (1 << (31 - WARP_FIX_BITS)) || col > (1 << (31 - WARP_FIX_BITS))) {
+		std::cerr << "warpAffine: src image is empty or too large!" << std::endl;
+		return false;
+	}
+
+	// dst -> src mapping
+	double* inv = map.inv;
+	if (!invert_affine(M, inv)) {
+		std::cerr << "warpAffine: M is not invertible!" << std::endl;
+		return false;
+	}
+	if (std::abs(inv[0]) >= (1 << 14) || std::abs(inv[3]) >= (1 << 14)) {
+		std::cerr << "warpAffine: M shrinks the image too much!" << std::endl;
+		return false;
+	}
+
+	// without dsize, dst is the bounding box of the transformed pixel centres
+	// and its top-left corner becomes the origin
+	int ox = 0, oy = 0;
+	size = dsize;
+	if (size.width <= 0 || size.height <= 0) {
+		double xs[4], ys[4];
+		for (int k = 0; k < 4; k++) {
+			double x = (k & 1) ? col - 1 : 0, y = (k & 2) ? row - 1 : 0;
+			xs[k] = M.at<double>(0, 0) * x + M.at<double>(0, 1) * y + M.at<double>(0, 2);
+			ys[k] = M.at<double>(1, 0) * x + M.at<double>(1, 1) * y + M.at<double>(1, 2);
+		}
+		ox = (int)std::ceil(*std::min_element(xs, xs + 4) - eps);
+		oy = (int)std::ceil(*std::min_element(ys, ys + 4) - eps);
+		size.width = (int)std::floor(*std::max_element(xs, xs + 4) + eps) - ox + 1;
+		size.height = (int)std::floor(*std::max_element(ys, ys + 4) + eps) - oy + 1;
+	}
+
+	// move the origin to (ox, oy), source coordinates advance by (DX, DY) along a row
+	inv[2] += inv[0] * ox + inv[1] * oy;
+	inv[5] += inv[3] * ox + inv[4] * oy;
+	map.DX = (int)warp_fix(inv[0]);
+	map.DY = (int)warp_fix(inv[3]);
+	return true;
+}
+
+// per-pixel gather table of a PreparedWarp
+struct WarpTable {
+	// valid span [j0, j1) of every dst row
+	std::vector<int> span;
+	// the pixels of row i start at start[i], empty when row-compressed
+	std::vector<size_t> start;
+	// offset of the top-left tap in elements and the packed weights fx | fy << 8
+	std::vector<int> ofs;
+	std::vector<ushort> wts;
+};
+
+// build the gather table of dst rows [i0, i1), sstep is the src row step in elements
+// a tap on the last column or row is moved one pixel back with full weight on
+// the second tap, which gives exactly what warp_bilinear_pixel_edge computes
+static void warp_build_table(const WarpAffineMap& map, cv::Size src_size, int cn, size_t sstep, WarpTable& table, int i0, int i1) {
+	int64 xmax = (int64)(src_size.width - 1) << WARP_FIX_BITS;
+	int64 ymax = (int64)(src_size.height - 1) << WARP_FIX_BITS;
+	for (int i = i0; i < i1; i++) {
+		int64 X0, Y0;
+		map.row_start(i, X0, Y0);
+		size_t k = table.start[i];
+		for (int j = table.span[2 * i]; j < table.span[2 * i + 1]; j++, k++) {
+			int X = (int)(X0 + (int64)j * map.DX), Y = (int)(Y0 + (int64)j * map.DY);
+			int sx = X >> WARP_FIX_BITS, sy = Y >> WARP_FIX_BITS;
+			int fx = (X >> WARP_FRAC_SHIFT) & (WARP_INTER_SIZE - 1);
+			int fy = (Y >> WARP_FRAC_SHIFT) & (WARP_INTER_SIZE - 1);
+			if (X == xmax) {
+				sx--;
+				fx = WARP_INTER_SIZE;
+			}
+			if (Y == ymax) {
+				sy--;
+				fy = WARP_INTER_SIZE;
+			}
+			table.ofs[k] = (int)(sy * sstep + sx * cn);
+			table.wts[k] = (ushort)(fx | fy << 8);
+		}
+	}
+}
+
+// gather n pixels through a table built by warp_build_table
+template<typename T, int cn>
+static void warp_table_row(const T* sdata, size_t sstep, const int* ofs, const ushort* wts, T* dst, int n) {
+	int j = warp_table_row_simd<cn>(sdata, sstep, ofs, wts, dst, n);
+	for (; j < n; j++) {
+		warp_bilinear_taps<T, cn>(sdata + ofs[j], sstep, wts[j] & 0xff, wts[j] >> 8, dst + j * cn);
+	}
+}
+
+// rows [i0, i1) and columns [j0, j1) of dst through a table, src must have the
+// row step the table was built for
+template<typename T, int cn>
+static void warp_prepared(const cv::Mat& src, cv::Mat& dst, const WarpAffineMap& map, const WarpTable& table, int i0, int i1, int j0, int j1) {
+	int n = j1 - j0;
+	for (int i = i0; i < i1; i++) {
+		T* d = dst.ptr<T>(i) + j0 * cn;
+		int s0 = std::min(std::max(table.span[2 * i] - j0, 0), n);
+		int s1 = std::min(std::max(table.span[2 * i + 1] - j0, s0), n);
+
+		if (table.ofs.empty()) {
+			// row-compressed: every row is an arithmetic progression from its start
+			int64 X, Y;
+			map.row_start(i, X, Y);
+			X += (int64)j0 * map.DX;
+			Y += (int64)j0 * map.DY;
+			warp_affine_span<T, cn>(src, d, X, Y, map.DX, map.DY, n, s0, s1);
+			continue;
+		}
+
+		warp_clear_outside(d, n, s0, s1, cn);
+		if (s0 < s1) {
+			size_t k = table.start[i] + (j0 + s0 - table.span[2 * i]);
+			warp_table_row<T, cn>(src.ptr<T>(), src.step / sizeof(T), table.ofs.data() + k, table.wts.data() + k, d + s0 * cn, s1 - s0);
+		}
+	}
+}
+
+// the dst rows [i0, i1) of one of the dedicated kernels
+typedef void (*WarpRowsKernel)(const cv::Mat&, cv::Mat&, const WarpAffineMap&, int, int);
+
+// rows [i0, i1) and columns [j0, j1) of the general path
+typedef void (*WarpGeneralKernel)(const cv::Mat&, cv::Mat&, const WarpAffineMap&, int, int, int, int);
+
+// rows [i0, i1) and columns [j0, j1) of the perspective path
+typedef void (*WarpPerspectiveKernel)(const cv::Mat&, cv::Mat&, const WarpPerspectiveMap&, int, int, int, int);
+
+// the kernels of one pixel type
+struct WarpKernels {
+	WarpRowsKernel copy, transpose, scale;
+	// indexed by WarpInterpolation
+	WarpGeneralKernel general[4];
+	WarpPerspectiveKernel perspective[4];
+	void (*prepared)(const cv::Mat&, cv::Mat&, const WarpAffineMap&, const WarpTable&, int, int, int, int);
+	// box reduction for large downscales
+	void (*reduce)(const cv::Mat&, cv::Mat&, int, int, int, int);
+	void (*scale_reduced)(const cv::Mat&, cv::Mat&, const WarpAffineMap&, int, int, cv::Size, const WarpAffineMap&);
+};
+
+template<typename T, int cn>
+static const WarpKernels* warp_kernels_of() {
+	static const WarpKernels kernels = {
+		warp_copy<T, cn>, warp_transpose<T, cn>, warp_scale<T, cn>,
+		{ warp_nearest<T, cn>, warp_general<T, cn>, warp_general_hi<T, cn, 4>, warp_general_hi<T, cn, 6> },
+		{ warp_perspective<T, cn, warp_nearest_row<T, cn> >, warp_perspective<T, cn, warp_affine_row<T, cn> >,
+			warp_perspective<T, cn, warp_hi_row<T, cn, 4> >, warp_perspective<T, cn, warp_hi_row<T, cn, 6> > },
+		warp_prepared<T, cn>,
+		warp_box_reduce<T, cn>, warp_scale_reduced<T, cn>
+	};
+	return &kernels;
+}
+
+// the kernels for a src type, nullptr if it is not supported
+static const WarpKernels* warp_kernels(int type) {
+	switch (type) {
+	case CV_8UC1:
+		return warp_kernels_of<uchar, 1>();
+	case CV_8UC3:
+		return warp_kernels_of<uchar, 3>();
+	case CV_8UC4:
+		return warp_kernels_of<uchar, 4>();
+	case CV_16UC1:
+		return warp_kernels_of<ushort, 1>();
+	case CV_16UC3:
+		return warp_kernels_of<ushort, 3>();
+	case CV_16UC4:
+		return warp_kernels_of<ushort, 4>();
+	case CV_32FC1:
+		return warp_kernels_of<float, 1>();
+	case CV_32FC3:
+		return warp_kernels_of<float, 3>();
+	case CV_32FC4:
+		return warp_kernels_of<float, 4>();
+	default:
+		return nullptr;
+	}
+}
+
+// the kernel of a non-general kind, nullptr for WARP_GENERAL
+// every kernel writes whole rows of its own band only
+// the copies are exact for every interpolation, the scaling is bilinear
+static WarpRowsKernel warp_rows_kernel(const WarpKernels& kernels, WarpKind kind, int interpolation) {
+	switch (kind) {
+	case WARP_IDENTITY:
+	case WARP_TRANSLATE:
+	case WARP_MIRROR:
+		return kernels.copy;
+	case WARP_ROTATE90:
+		return kernels.transpose;
+	case WARP_SCALE:
+		return interpolation == WARP_INTER_LINEAR ? kernels.scale : nullptr;
+	default:
+		return nullptr;
+	}
+}
+
+// pyramid levels of an axis-aligned downscaling by 2 or more: src is first box
+// reduced by 2^lx x 2^ly, the largest powers of two not above the factors of the
+// axes up to WARP_BOX_MAX_LEVELS, returns false if neither axis shrinks enough
+static bool warp_downscale_levels(const WarpAffineMap& map, int& lx, int& ly) {
+	lx = ly = 0;
+	while (lx < WARP_BOX_MAX_LEVELS && std::abs(map.inv[0]) >= (2 << lx) - 1e-9) {
+		lx++;
+	}
+	while (ly < WARP_BOX_MAX_LEVELS && std::abs(map.inv[4]) >= (2 << ly) - 1e-9) {
+		ly++;
+	}
+	return lx > 0 || ly > 0;
+}
+
+// the map of the reduced image: reduced pixel u averages src pixels [u * s, (u + 1) * s)
+// and sits at their centre
+static WarpAffineMap warp_reduced_map(const WarpAffineMap& map, int lx, int ly) {
+	double sx = 1 << lx, sy = 1 << ly;
+	WarpAffineMap rmap = map;
+	rmap.inv[0] = map.inv[0] / sx;
+	rmap.inv[2] = (map.inv[2] - (sx - 1) / 2) / sx;
+	rmap.inv[4] = map.inv[4] / sy;
+	rmap.inv[5] = (map.inv[5] - (sy - 1) / 2) / sy;
+	rmap.DX = (int)warp_fix(rmap.inv[0]);
+	rmap.DY = (int)warp_fix(rmap.inv[3]);
+	rmap.src_row0 = map.src_row0 >> ly;
+	return rmap;
+}
+
+// axis-aligned downscaling by 2 or more: src is box reduced to the pyramid level
+// in one pass, then the rest is scaled bilinearly from the reduced image, so that
+// every src pixel is averaged in instead of aliasing through the 2x2 taps
+// map.src_row0 must be a multiple of 2^ly, which keeps the boxes of a src window
+// the boxes of the whole src
+// returns false if neither axis shrinks enough
+static bool warp_downscale(const WarpKernels& kernels, const cv::Mat& src, cv::Mat& dst, const WarpAffineMap& map,
+	const ParallelOptions& opts) {
+	int lx, ly;
+	if (!warp_downscale_levels(map, lx, ly)) {
+		return false;
+	}
+
+	// no level in between, each would be written and read back once more
+	cv::Mat level((src.rows + (1 << ly) - 1) >> ly, (src.cols + (1 << lx) - 1) >> lx, src.type());
+	parallel_for_rows(0, level.rows, src.cols << ly, [&](int i0, int i1) {
+		kernels.reduce(src, level, lx, ly, i0, i1);
+	}, opts);
+
+	WarpAffineMap rmap = warp_reduced_map(map, lx, ly);
+	parallel_for_rows(0, dst.rows, dst.cols, [&](int i0, int i1) {
+		kernels.scale_reduced(level, dst, rmap, i0, i1, src.size(), map);
+	}, opts);
+	return true;
+}
+
+// warp src into dst with the kernel of kind, dst is allocated
+static void warp_run(const WarpKernels& kernels, const cv::Mat& src, cv::Mat& dst, const WarpAffineMap& map, WarpKind kind,
+	const WarpOptions& opts) {
+	if (kind == WARP_SCALE && opts.interpolation == WARP_INTER_LINEAR && opts.antialias
+		&& warp_downscale(kernels, src, dst, map, opts)) {
+		return;
+	}
+
+	WarpRowsKernel kernel = warp_rows_kernel(kernels, kind, opts.interpolation);
+	if (kernel) {
+		parallel_for_rows(0, dst.rows, dst.cols, [&](int i0, int i1) {
+			kernel(src, dst, map, i0, i1);
+		}, opts);
+		return;
+	}
+
+	WarpGeneralKernel general = kernels.general[opts.interpolation];
+	warp_traverse(map, (int)src.elemSize(), dst.size(), opts, [&](int i0, int i1, int j0, int j1) {
+		general(src, dst, map, i0, i1, j0, j1);
+	});
+}
+
+// src, or a copy of it if dst shares its pixels, which the kernels would read
+// after overwriting them
+static cv::Mat warp_source(const cv::Mat& src, const cv::Mat& dst) {
+	if (dst.datastart && dst.datastart == src.datastart) {
+		return src.clone();
+	}
+	return src;
+}
+
+// Applies an affine transformation to an image.
+//
+// opts.interpolation picks nearest, bilinear (the default), bicubic or Lanczos-3,
+// taps of the last two outside of src are replaced by the nearest border pixel
+// bilinear axis-aligned downscaling by 2 or more box-filters src first when
+// opts.antialias is set
+// src is 8U, 16U or 32F with 1, 3 or 4 channels, dst gets the type of src
+// M.type() must be CV_64FC1
+// dst is dsize when given, otherwise the bounding box of the transformed src
+// whose top-left corner becomes (0, 0), M's translation is then dropped
+// source coordinates are stepped in 16.16 fixed point, so src must be smaller than 32768x32768
+// rows (tiles for rotations) are spread over the thread pool as opts says,
+// the result does not depend on the number of threads nor on the traversal
+void warpAffine(const cv::Mat& src, cv::Mat& dst, const cv::Mat& M, cv::Size& dsize, const WarpOptions& opts) {
+	const WarpKernels* kernels = warp_kernels(src.type());
+	if (!kernels) {
+		std::cerr << "warpAffine: src type is not supported, only 8U, 16U and 32F with 1, 3 or 4 channels are!" << std::endl;
+		return;
+	}
+	if (opts.interpolation < WARP_INTER_NEAREST || opts.interpolation > WARP_INTER_LANCZOS3) {
+		std::cerr << "warpAffine: unknown interpolation!" << std::endl;
+		return;
+	}
+
+	WarpAffineMap map;
+	cv::Size size;
+	if (!warp_prepare(src.size(), M, dsize, map, size)) {
+		return;
+	}
+	cv::Mat in = warp_source(src, dst);
+	dst.create(size, in.type());
+	warp_run(*kernels, in, dst, map, classify_affine(map.inv), opts);
+}
+
+struct PreparedWarp::Impl {
+	WarpAffineMap map;
+	WarpKind kind;
+	const WarpKernels* kernels;
+	cv::Size src_size, size;
+	int type;
+	// src row step in bytes the table offsets are computed for
+	size_t sstep;
+	// general kind only
+	WarpTable table;
+};
+
+PreparedWarp::PreparedWarp(const cv::Mat& M, cv::Size src_size, int type, cv::Size dsize, size_t max_bytes) {
+	const WarpKernels* kernels = warp_kernels(type);
+	if (!kernels) {
+		std::cerr << "warpAffine: src type is not supported, only 8U, 16U and 32F with 1, 3 or 4 channels are!" << std::endl;
+		return;
+	}
+
+	std::shared_ptr<Impl> p = std::make_shared<Impl>();
+	if (!warp_prepare(src_size, M, dsize, p->map, p->size)) {
+		return;
+	}
+	p->kind = classify_affine(p->map.inv);
+	p->kernels = kernels;
+	p->src_size = src_size;
+	p->type = type;
+	p->sstep = (size_t)src_size.width * CV_ELEM_SIZE(type);
+
+	if (p->kind == WARP_GENERAL) {
+		const WarpAffineMap& map = p->map;
+		WarpTable& table = p->table;
+		int rows = p->size.height, cols = p->size.width;
+		table.span.resize(2 * (size_t)rows);
+		size_t total = 0;
+		for (int i = 0; i < rows; i++) {
+			int64 X0, Y0;
+			map.row_start(i, X0, Y0);
+			warp_row_span(src_size, X0, Y0, map.DX, map.DY, cols, table.span[2 * i], table.span[2 * i + 1]);
+			total += table.span[2 * i + 1] - table.span[2 * i];
+		}
+
+		// the table needs two taps per axis and 32-bit offsets
+		int cn = CV_MAT_CN(type);
+		size_t sstep = (size_t)src_size.width * cn;
+		size_t bytes = total * (sizeof(int) + sizeof(ushort)) + rows * sizeof(size_t);
+		bool fits = src_size.width >= 2 && src_size.height >= 2 && (double)sstep * src_size.height < (double)INT_MAX;
+		if (fits && bytes <= max_bytes) {
+			table.start.resize(rows);
+			size_t k = 0;
+			for (int i = 0; i < rows; i++) {
+				table.start[i] = k;
+				k += table.span[2 * i + 1] - table.span[2 * i];
+			}
+			table.ofs.resize(total);
+			table.wts.resize(total);
+			parallel_for_rows(0, rows, cols, [&](int i0, int i1) {
+				warp_build_table(map, src_size, cn, sstep, table, i0, i1);
+			});
+		}
+	}
+
+	impl = p;
+}
+
+bool PreparedWarp::empty() const {
+	return !impl;
+}
+
+cv::Size PreparedWarp::size() const {
+	return impl ? impl->size : cv::Size();
+}
+
+bool PreparedWarp::compressed() const {
+	return impl && impl->table.ofs.empty();
+}
+
+size_t PreparedWarp::table_bytes() const {
+	if (!impl) {
+		return 0;
+	}
+	const WarpTable& table = impl->table;
+	return table.span.size() * sizeof(int) + table.start.size() * sizeof(size_t)
+		+ table.ofs.size() * sizeof(int) + table.wts.size() * sizeof(ushort);
+}
+
+void PreparedWarp::apply(const cv::Mat& frame, cv::Mat& dst, const WarpOptions& opts) const {
+	if (!impl) {
+		std::cerr << "PreparedWarp: not prepared!" << std::endl;
+		return;
+	}
+	const Impl& p = *impl;
+	if (frame.size() != p.src_size || frame.type() != p.type) {
+		std::cerr << "PreparedWarp: frame size or type differs from the prepared one!" << std::endl;
+		return;
+	}
+	if (opts.interpolation < WARP_INTER_NEAREST || opts.interpolation > WARP_INTER_LANCZOS3) {
+		std::cerr << "warpAffine: unknown interpolation!" << std::endl;
+		return;
+	}
+	cv::Mat src = warp_source(frame, dst);
+	dst.create(p.size, p.type);
+
+	// the table is bilinear and general only, everything else runs like warpAffine
+	if (p.kind != WARP_GENERAL || opts.interpolation != WARP_INTER_LINEAR) {
+		warp_run(*p.kernels, src, dst, p.map, p.kind, opts);
+		return;
+	}
+
+	// the offsets assume rows of sstep bytes, other layouts (ROIs) are packed first
+	if (!p.table.ofs.empty() && src.step != p.sstep) {
+		src = src.clone();
+	}
+	warp_traverse(p.map, CV_ELEM_SIZE(p.type), p.size, opts, [&](int i0, int i1, int j0, int j1) {
+		p.kernels->prepared(src, dst, p.map, p.table, i0, i1, j0, j1);
+	});
+}
+
+// check M and src_size, invert M and find the size of dst like warp_prepare
+// returns false if M is not a 3x3 CV_64FC1 matrix or not invertible, or if src
+// does not map to a bounded dst and dsize is not given
+static bool warp_prepare_perspective(cv::Size src_size, const cv::Mat& M, cv::Size dsize, WarpPerspectiveMap& map,
+	cv::Size& size) {
+	const double eps = 1e-6;
+	int row = src_size.height;
+	int col = src_size.width;
+
+	if (row <= 0 || col <= 0 || row > (1 << (31 - WARP_FIX_BITS)) || col > (1 << (31 - WARP_FIX_BITS))) {
+		std::cerr << "warpPerspective: src image is empty or too large!" << std::endl;
+		return false;
+	}
+	if (M.rows != 3 || M.cols != 3 || M.type() != CV_64FC1) {
+		std::cerr << "warpPerspective: M must be a 3x3 CV_64FC1 matrix!" << std::endl;
+		return false;
+	}
+
+	// dst -> src mapping, the adjugate of M divided by its determinant
+	double m[9], *inv = map.inv;
+	for (int k = 0; k < 9; k++) {
+		m[k] = M.at<double>(k / 3, k % 3);
+	}
+	inv[0] = m[4] * m[8] - m[5] * m[7];
+	inv[1] = m[2] * m[7] - m[1] * m[8];
+	inv[2] = m[1] * m[5] - m[2] * m[4];
+	inv[3] = m[5] * m[6] - m[3] * m[8];
+	inv[4] = m[0] * m[8] - m[2] * m[6];
+	inv[5] = m[2] * m[3] - m[0] * m[5];
+	inv[6] = m[3] * m[7] - m[4] * m[6];
+	inv[7] = m[1] * m[6] - m[0] * m[7];
+	inv[8] = m[0] * m[4] - m[1] * m[3];
+	double det = m[0] * inv[0] + m[1] * inv[3] + m[2] * inv[6];
+	if (std::abs(det) < 1e-12) {
+		std::cerr << "warpPerspective: M is not invertible!" << std::endl;
+		return false;
+	}
+	for (int k = 0; k < 9; k++) {
+		inv[k] /= det;
+	}
+
+	// without dsize, dst is the bounding box of the transformed pixel centres
+	// and its top-left corner becomes the origin
+	int ox = 0, oy = 0;
+	size = dsize;
+	if (size.width <= 0 || size.height <= 0) {
+		double xs[4], ys[4];
+		for (int k = 0; k < 4; k++) {
+			double x = (k & 1) ? col - 1 : 0, y = (k & 2) ? row - 1 : 0;
+			double w = m[6] * x + m[7] * y + m[8];
+			if (w <= eps) {
+				std::cerr << "warpPerspective: src is not mapped to a bounded area, dsize is needed!" << std::endl;
+				return false;
+			}
+			xs[k] = (m[0] * x + m[1] * y + m[2]) / w;
+			ys[k] = (m[3] * x + m[4] * y + m[5]) / w;
+		}
+		double x0 = *std::min_element(xs, xs + 4), x1 = *std::max_element(xs, xs + 4);
+		double y0 = *std::min_element(ys, ys + 4), y1 = *std::max_element(ys, ys + 4);
+		if (x1 - x0 >= INT_MAX / 2 || y1 - y0 >= INT_MAX / 2) {
+			std::cerr << "warpPerspective: src is not mapped to a bounded area, dsize is needed!" << std::endl;
+			return false;
+		}
+		ox = (int)std::ceil(x0 - eps);
+		oy = (int)std::ceil(y0 - eps);
+		size.width = (int)std::floor(x1 + eps) - ox + 1;
+		size.height = (int)std::floor(y1 + eps) - oy + 1;
+	}
+
+	// move the origin to (ox, oy)
+	inv[2] += inv[0] * ox + inv[1] * oy;
+	inv[5] += inv[3] * ox + inv[4] * oy;
+	inv[8] += inv[6] * ox + inv[7] * oy;
+	return true;
+}
+
+// Applies a perspective transformation (homography) to an image, e.g., to rectify
+// a photographed document.
+//
+// M.type() must be CV_64FC1 and M must be 3x3, src, opts and the interpolations
+// are those of warpAffine
+// dst is dsize when given, otherwise the bounding box of the transformed src like
+// for warpAffine, which needs every corner of src in front of the camera
+// along a dst row the src coordinates are computed exactly every few pixels and
+// stepped linearly in between, off by less than 1/256 pixel; an M whose last row
+// is (0, 0, w) is warped by warpAffine
+void warpPerspective(const cv::Mat& src, cv::Mat& dst, const cv::Mat& M, cv::Size& dsize, const WarpOptions& opts) {
+	const WarpKernels* kernels = warp_kernels(src.type());
+	if (!kernels) {
+		std::cerr << "warpPerspective: src type is not supported, only 8U, 16U and 32F with 1, 3 or 4 channels are!" << std::endl;
+		return;
+	}
+	if (opts.interpolation < WARP_INTER_NEAREST || opts.interpolation > WARP_INTER_LANCZOS3) {
+		std::cerr << "warpPerspective: unknown interpolation!" << std::endl;
+		return;
+	}
+
+	if (M.rows == 3 && M.cols == 3 && M.type() == CV_64FC1 && M.at<double>(2, 0) == 0 && M.at<double>(2, 1) == 0
+		&& M.at<double>(2, 2) != 0) {
+		cv::Mat A(2, 3, CV_64FC1);
+		for (int k = 0; k < 6; k++) {
+			A.at<double>(k / 3, k % 3) = M.at<double>(k / 3, k % 3) / M.at<double>(2, 2);
+		}
+		warpAffine(src, dst, A, dsize, opts);
+		return;
+	}
+
+	WarpPerspectiveMap map;
+	cv::Size size;
+	if (!warp_prepare_perspective(src.size(), M, dsize, map, size)) {
+		return;
+	}
+	cv::Mat in = warp_source(src, dst);
+	dst.create(size, in.type());
+
+	// rows or tiles are picked from the affine part of the mapping at the centre of dst
+	const double* h = map.inv;
+	double x = size.width / 2, y = size.height / 2, w = h[6] * x + h[7] * y + h[8];
+	double sx = (h[0] * x + h[1] * y + h[2]) / w, sy = (h[3] * x + h[4] * y + h[5]) / w;
+	WarpAffineMap local;
+	local.inv[0] = (h[0] - sx * h[6]) / w;
+	local.inv[1] = (h[1] - sx * h[7]) / w;
+	local.inv[3] = (h[3] - sy * h[6]) / w;
+	local.inv[4] = (h[4] - sy * h[7]) / w;
+	local.inv[2] = local.inv[5] = 0;
+	local.DX = local.DY = 0;
+
+	WarpPerspectiveKernel kernel = kernels->perspective[opts.interpolation];
+	warp_traverse(local, (int)in.elemSize(), size, opts, [&](int i0, int i1, int j0, int j1) {
+		kernel(in, dst, map, i0, i1, j0, j1);
+	});
+}
+
+// src rows [r0, r1) read by the valid pixels of dst rows [i0, i1) and columns [j0, j1),
+// r0 == r1 when none of them is valid
+// validity is decided by map on a src of src_size, the pixels then sample smap
+// with taps rows per axis, and row k of smap covers src rows [k << ly, (k + 1) << ly)
+static void warp_stream_rows(const WarpAffineMap& map, const WarpAffineMap& smap, int ly, int taps, cv::Size src_size,
+	int i0, int i1, int j0, int j1, int& r0, int& r1) {
+	int64 ymin = std::numeric_limits<int64>::max(), ymax = std::numeric_limits<int64>::min();
+	for (int i = i0; i < i1; i++) {
+		int64 X, Y;
+		int s0, s1;
+		map.row_start(i, X, Y);
+		warp_row_span(src_size, X + (int64)j0 * map.DX, Y + (int64)j0 * map.DY, map.DX, map.DY, j1 - j0, s0, s1);
+		if (s0 == s1) {
+			continue;
+		}
+		// the extremes of a linear function are at the ends of the span
+		smap.row_start(i, X, Y);
+		int64 ya = Y + (int64)(j0 + s0) * smap.DY, yb = Y + (int64)(j0 + s1 - 1) * smap.DY;
+		ymin = std::min(ymin, std::min(ya, yb));
+		ymax = std::max(ymax, std::max(ya, yb));
+	}
+
+	r0 = r1 = 0;
+	if (ymin > ymax) {
+		return;
+	}
+	int rows = (src_size.height + (1 << ly) - 1) >> ly;
+	int k0 = (int)std::max((ymin >> WARP_FIX_BITS) - (taps / 2 - 1), (int64)0);
+	int k1 = (int)std::min((ymax >> WARP_FIX_BITS) + taps / 2 + 1, (int64)rows);
+	r0 = k0 << ly;
+	r1 = std::min(k1 << ly, src_size.height);
+}
+
+// make src rows [r0, r1) the rows of window, which holds [w0, w1) so far
+// the rows both have in common are moved, only the others are read
+static bool warp_stream_load(cv::Mat& window, int& w0, int& w1, int r0, int r1, const WarpRowReader& reader) {
+	int o0 = std::max(r0, w0), o1 = std::min(r1, w1);
+	if (o0 < o1) {
+		memmove(window.ptr(o0 - r0), window.ptr(o0 - w0), (size_t)(o1 - o0) * window.step);
+	}
+	else {
+		o0 = o1 = r0;
+	}
+	w0 = w1 = 0;
+
+	int parts[2][2] = { { r0, o0 }, { o1, r1 } };
+	for (int k = 0; k < 2; k++) {
+		if (parts[k][0] == parts[k][1]) {
+			continue;
+		}
+		cv::Mat rows = window.rowRange(parts[k][0] - r0, parts[k][1] - r0);
+		const uchar* data = rows.data;
+		if (!reader(parts[k][0], rows)) {
+			std::cerr << "warpAffineStream: reading src rows failed!" << std::endl;
+			return false;
+		}
+		if (rows.data != data) {
+			std::cerr << "warpAffineStream: the reader must fill the given rows in place!" << std::endl;
+			return false;
+		}
+	}
+	w0 = r0;
+	w1 = r1;
+	return true;
+}
+
+// warpAffine of a src that is read strip by strip into a window of rows and of a
+// dst that is written strip by strip
+//
+// every strip of dst rows loads exactly the src rows its valid pixels read, reusing
+// the rows the previous strip has loaded already; the strip is halved until that
+// fits max_bytes, and a single row that still does not is warped in column chunks
+// through the general kernel, which gives the same pixels as the dedicated ones
+bool warpAffineStream(cv::Size src_size, int type, const WarpRowReader& reader, const cv::Mat& M, cv::Size& dsize,
+	const WarpRowWriter& writer, const WarpStreamOptions& opts) {
+	const WarpKernels* kernels = warp_kernels(type);
+	if (!kernels) {
+		std::cerr << "warpAffine: src type is not supported, only 8U, 16U and 32F with 1, 3 or 4 channels are!" << std::endl;
+		return false;
+	}
+	if (opts.interpolation < WARP_INTER_NEAREST || opts.interpolation > WARP_INTER_LANCZOS3) {
+		std::cerr << "warpAffine: unknown interpolation!" << std::endl;
+		return false;
+	}
+
+	WarpAffineMap map;
+	cv::Size size;
+	if (!warp_prepare(src_size, M, dsize, map, size)) {
+		return false;
+	}
+	dsize = size;
+	WarpKind kind = classify_affine(map.inv);
+
+	// a box reduced downscaling samples the pyramid level, whose rows cover 2^ly src rows
+	int lx = 0, ly = 0;
+	bool reduced = kind == WARP_SCALE && opts.interpolation == WARP_INTER_LINEAR && opts.antialias
+		&& warp_downscale_levels(map, lx, ly);
+	WarpAffineMap smap = reduced ? warp_reduced_map(map, lx, ly) : map;
+	const int taps[] = { 2, 2, 4, 6 };
+	int N = taps[opts.interpolation];
+
+	// the strip takes a quarter of max_bytes, the src window the rest, and its box
+	// reduction is smaller than the window itself
+	size_t src_row = (size_t)src_size.width * CV_ELEM_SIZE(type), dst_row = (size_t)size.width * CV_ELEM_SIZE(type);
+	size_t strip = opts.strip_rows > 0 ? (size_t)opts.strip_rows : std::max(opts.max_bytes / 4 / dst_row, (size_t)1);
+	strip = std::min(strip, (size_t)size.height);
+	size_t capacity = strip * dst_row < opts.max_bytes ? (opts.max_bytes - strip * dst_row) / (reduced ? 2 * src_row : src_row) : 0;
+	capacity = std::min(capacity, (size_t)src_size.height);
+	if (capacity < (size_t)N) {
+		std::cerr << "warpAffineStream: max_bytes is too small!" << std::endl;
+		return false;
+	}
+	cv::Mat window((int)capacity, src_size.width, type), buf((int)strip, size.width, type);
+	int w0 = 0, w1 = 0;
+
+	for (int i0 = 0, h = (int)strip; i0 < size.height;) {
+		h = std::min(h, size.height - i0);
+		int r0, r1;
+		warp_stream_rows(map, smap, ly, N, src_size, i0, i0 + h, 0, size.width, r0, r1);
+		while ((size_t)(r1 - r0) > capacity && h > 1) {
+			h /= 2;
+			warp_stream_rows(map, smap, ly, N, src_size, i0, i0 + h, 0, size.width, r0, r1);
+		}
+		cv::Mat dst = buf.rowRange(0, h);
+
+		if ((size_t)(r1 - r0) <= capacity) {
+			if (r0 == r1) {
+				dst.setTo(0);
+			}
+			else {
+				if (!warp_stream_load(window, w0, w1, r0, r1, reader)) {
+					return false;
+				}
+				WarpAffineMap m = map;
+				m.row0 = i0;
+				m.src_row0 = r0;
+				warp_run(*kernels, window.rowRange(0, r1 - r0), dst, m, kind, opts);
+			}
+		}
+		else {
+			// a single row: columns [j0, j1) at a time, the box reduction cannot be cut into columns
+			if (reduced) {
+				std::cerr << "warpAffineStream: max_bytes is too small!" << std::endl;
+				return false;
+			}
+			WarpGeneralKernel general = kernels->general[opts.interpolation];
+			for (int j0 = 0, w = size.width; j0 < size.width; j0 += w) {
+				w = std::min(w, size.width - j0);
+				warp_stream_rows(map, smap, ly, N, src_size, i0, i0 + 1, j0, j0 + w, r0, r1);
+				while ((size_t)(r1 - r0) > capacity && w > 1) {
+					w /= 2;
+					warp_stream_rows(map, smap, ly, N, src_size, i0, i0 + 1, j0, j0 + w, r0, r1);
+				}
+				if (r0 == r1) {
+					memset(dst.ptr(0) + j0 * dst.elemSize(), 0, (size_t)w * dst.elemSize());
+					continue;
+				}
+				if (!warp_stream_load(window, w0, w1, r0, r1, reader)) {
+					return false;
+				}
+				WarpAffineMap m = map;
+				m.row0 = i0;
+				m.src_row0 = r0;
+				general(window.rowRange(0, r1 - r0), dst, m, 0, 1, j0, j0 + w);
+			}
+		}
+
+		if (!writer(i0, dst)) {
+			std::cerr << "warpAffineStream: writing dst rows failed!" << std::endl;
+			return false;
+		}
+		// strips that had to be halved grow back
+		i0 += h;
+		h = (int)std::min((size_t)h * 2, strip);
+	}
+	return true;
+}
+
+// add the levels of n bytes at p to the four sub-histograms of bank
+// equal neighbours, e.g., of a flat scanned background, would increment one counter
+// back to back and wait for each store to be forwarded to the next load, so the
+// bytes are spread over four sub-histograms, eight per iteration read as two words
+static inline void hist_count_banked(const uchar* p, size_t n, int bank[4][256]) {
+	size_t k = 0;
+	for (; k + 8 <= n; k += 8) {
+		unsigned a, b;
+		memcpy(&a, p + k, 4);
+		memcpy(&b, p + k + 4, 4);
+		bank[0][a & 255]++;
+		bank[1][(a >> 8) & 255]++;
+		bank[2][(a >> 16) & 255]++;
+		bank[3][a >> 24]++;
+		bank[0][b & 255]++;
+		bank[1][(b >> 8) & 255]++;
+		bank[2][(b >> 16) & 255]++;
+		bank[3][b >> 24]++;
+	}
+	for (; k < n; k++) {
+		bank[0][p[k]]++;
+	}
+}
+
+// add the levels of n bytes at p to hist
+static void hist_count_bytes(const uchar* p, size_t n, int hist[256]) {
+	int bank[4][256] = {};
+	hist_count_banked(p, n, bank);
+	for (int v = 0; v < 256; v++) {
+		hist[v] += bank[0][v] + bank[1][v] + bank[2][v] + bank[3][v];
+	}
+}
+
+// count the times each grey level occurs in a CV_8UC1 image
+std::vector<int> count_hist_grey(const cv::Mat& img, const ParallelOptions& opts) {
+	std::vector<int> hist(256, 0);
+	if (img.type() != CV_8U) {
+		std::cout << "count_hist_grey: img's type is not CV_8U\n";
+		return hist;
+	}
+
+	// the rows of a task are one buffer when img is continuous, every task
+	// counts on its own and the counts are summed at the end
+	std::mutex mutex;
+	parallel_for_rows(0, img.rows, img.cols, [&](int i0, int i1) {
+		int part[256] = {};
+		if (img.isContinuous()) {
+			hist_count_bytes(img.ptr(i0), (size_t)(i1 - i0) * img.cols, part);
+		}
+		else {
+			for (int i = i0; i < i1; i++) {
+				hist_count_bytes(img.ptr(i), img.cols, part);
+			}
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int v = 0; v < 256; v++) {
+			hist[v] += part[v];
+		}
+	}, opts);
+	return hist;
+}
+
+// add n pixels of 3 interleaved channels at p to hist, channel c at hist + 256 * c
+// the channels already alternate between three tables, so two banks per channel,
+// for even and odd pixels, keep equal neighbours apart
+static void hist_count_pixels3(const uchar* p, size_t n, int* hist) {
+	int bank[2][3][256] = {};
+	size_t k = 0;
+	for (; k + 2 <= n; k += 2, p += 6) {
+		bank[0][0][p[0]]++;
+		bank[0][1][p[1]]++;
+		bank[0][2][p[2]]++;
+		bank[1][0][p[3]]++;
+		bank[1][1][p[4]]++;
+		bank[1][2][p[5]]++;
+	}
+	if (k < n) {
+		bank[0][0][p[0]]++;
+		bank[0][1][p[1]]++;
+		bank[0][2][p[2]]++;
+	}
+	for (int c = 0; c < 3; c++) {
+		for (int v = 0; v < 256; v++) {
+			hist[256 * c + v] += bank[0][c][v] + bank[1][c][v];
+		}
+	}
+}
+
+// count the times each level occurs in every channel of a CV_8UC3 image
+std::vector<int> count_hist_color(const cv::Mat& img, const ParallelOptions& opts) {
+	std::vector<int> hist(3 * 256, 0);
+	if (img.type() != CV_8UC3) {
+		std::cout << "count_hist_color: img's not CV_8UC3\n";
+		return hist;
+	}
+
+	std::mutex mutex;
+	parallel_for_rows(0, img.rows, img.cols, [&](int i0, int i1) {
+		int part[3 * 256] = {};
+		if (img.isContinuous()) {
+			hist_count_pixels3(img.ptr(i0), (size_t)(i1 - i0) * img.cols, part);
+		}
+		else {
+			for (int i = i0; i < i1; i++) {
+				hist_count_pixels3(img.ptr(i), img.cols, part);
+			}
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int v = 0; v < 3 * 256; v++) {
+			hist[v] += part[v];
+		}
+	}, opts);
+	return hist;
+}
+
+// count the pixels of a CV_8UC3 image in bins^3 bins of their quantized levels
+std::vector<int> count_hist_joint(const cv::Mat& img, int bins, const ParallelOptions& opts) {
+	if (img.type() != CV_8UC3) {
+		std::cout << "count_hist_joint: img's not CV_8UC3\n";
+		return std::vector<int>();
+	}
+	if (bins < 1 || bins > 64 || (bins & (bins - 1))) {
+		std::cout << "count_hist_joint: bins is not a power of two up to 64\n";
+		return std::vector<int>();
+	}
+	int shift = 0;
+	while ((256 >> shift) > bins) {
+		shift++;
+	}
+	int bits = 8 - shift;
+
+	// one table per task, they are too large to be banked
+	std::vector<int> hist(bins * bins * bins, 0);
+	std::mutex mutex;
+	parallel_for_rows(0, img.rows, img.cols, [&](int i0, int i1) {
+		std::vector<int> part(hist.size(), 0);
+		for (int i = i0; i < i1; i++) {
+			const uchar* p = img.ptr(i);
+			for (int j = 0; j < img.cols; j++, p += 3) {
+				part[(((p[0] >> shift) << bits | p[1] >> shift) << bits) | p[2] >> shift]++;
+			}
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		for (size_t v = 0; v < hist.size(); v++) {
+			hist[v] += part[v];
+		}
+	}, opts);
+	return hist;
+}
+
+// running sums of hist, the last one is the pixel count
+std::vector<int> cumulative_hist(const std::vector<int>& hist) {
+	std::vector<int> cum(hist.size());
+	int sum = 0;
+	for (size_t v = 0; v < hist.size(); v++) {
+		sum += hist[v];
+		cum[v] = sum;
+	}
+	return cum;
+}
+
+// P(f) of hist or, if cumulative, C(f)
+std::vector<double> normalize_hist(const std::vector<int>& hist, bool cumulative) {
+	std::vector<double> p(hist.size());
+	double total = 0;
+	for (int c : hist) {
+		total += c;
+	}
+	if (total == 0) {
+		return p;
+	}
+	for (size_t v = 0; v < hist.size(); v++) {
+		p[v] = hist[v] / total;
+		if (cumulative && v > 0)
+			p[v] += p[v - 1];
+	}
+	return p;
+}
+
+// plot the 256 counts of count_hist_grey
+// return a Mat that can be directly plotted
+cv::Mat plot_hist_grey(const std::vector<int>& hist) {
+	cv::Mat hist_img = cv::Mat(hist_height, hist_width, CV_8UC3, cv::Scalar(225, 228, 255));
+	if (hist.size() != 256) {
+		std::cout << "plot_hist_grey: hist does not have 256 bins\n";
+		return hist_img;
+	}
+	std::vector<double> p = normalize_hist(hist);
+	double hist_max = *std::max_element(p.begin(), p.end());
+	if (hist_max <= 0) {
+		return hist_img;
+	}
+
+	for (int i = 0; i < 255; i++) {
+		cv::line(hist_img, cv::Point(i * bin_width, (int)(hist_height * (1 - p[i] / hist_max))),
+			cv::Point((i + 1) * bin_width, (int)(hist_height * (1 - p[i + 1] / hist_max))),
+			cv::Scalar(205, 0, 0), 2, cv::LINE_AA);
+	}
+
+	return hist_img;
+}
+
+// calculate the histogram of a grey scale image
+// return a Mat that can be directly plotted
+cv::Mat cal_hist_grey(const cv::Mat& img) {
+	return plot_hist_grey(count_hist_grey(img));
+}
+
+// the mapping g of histogram equalization from the counts of the grey levels,
+// g(f) = 255 * C(f) rounded, in integers so that it does not depend on how C(f) is summed
+static void hist_equalization_lut(const int hist[256], uchar value[256]) {
+	const long long max = 255;
+	long long total = 0, cum = 0;
+	for (int v = 0; v <= max; v++) {
+		total += hist[v];
+	}
+	for (int i = 0; i <= max; i++) {
+		cum += hist[i];
+		value[i] = total ? (uchar)((2 * max * cum + total) / (2 * total)) : 0;
+	}
+}
+
+// map n bytes at p through value to q, q may be p
+// a 256-entry byte table stays in L1, so one load per byte is as fast as it gets
+static inline void hist_map_bytes(const uchar* p, uchar* q, size_t n, const uchar value[256]) {
+	for (size_t k = 0; k < n; k++) {
+		q[k] = value[p[k]];
+	}
+}
+
+// bytes counted and mapped at a time by the fused pass, small enough to be
+// still in L1 when they are mapped
+const size_t HIST_FUSED_CHUNK = 4096;
+
+// map the rows [i0, i1) of the CV_8UC1 src to dst through value
+// if hist is given, the rows are counted into it first, chunk by chunk, so
+// that every byte is read from memory once
+static void hist_map_rows(const cv::Mat& src, cv::Mat& dst, int i0, int i1, const uchar value[256], int* hist) {
+	int rows = i1 - i0;
+	size_t n = src.cols;
+	if (src.isContinuous() && dst.isContinuous()) {
+		n *= rows;
+		rows = 1;
+	}
+	for (int i = i0; i < i0 + rows; i++) {
+		const uchar* p = src.ptr(i);
+		uchar* q = dst.ptr(i);
+		for (size_t k = 0; k < n; k += HIST_FUSED_CHUNK) {
+			size_t m = std::min(HIST_FUSED_CHUNK, n - k);
+			if (hist) {
+				hist_count_bytes(p + k, m, hist);
+			}
+			hist_map_bytes(p + k, q + k, m, value);
+		}
+	}
+}
+
+// map the CV_8UC1 src to dst through value over the thread pool
+// if hist is given, src is counted into it in the same pass
+static void hist_map_parallel(const cv::Mat& src, cv::Mat& dst, const uchar value[256], int* hist,
+	const ParallelOptions& opts) {
+	std::mutex mutex;
+	parallel_for_rows(0, src.rows, src.cols, [&](int i0, int i1) {
+		if (!hist) {
+			hist_map_rows(src, dst, i0, i1, value, nullptr);
+			return;
+		}
+		int part[256] = {};
+		hist_map_rows(src, dst, i0, i1, value, part);
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int v = 0; v < 256; v++) {
+			hist[v] += part[v];
+		}
+	}, opts);
+}
+
+// bins of the 16-bit and float equalizations
+const int HIST_WIDE_BINS = 1 << 16;
+
+// the 16-bit counterpart of count_hist_grey
+// 12-bit sensor data only touches 4096 of the 65536 counters, which stay in L1,
+// and every task remembers the range it touched so that only that is merged
+static std::vector<int> count_hist_16u(const cv::Mat& img, const ParallelOptions& opts) {
+	std::vector<int> hist(HIST_WIDE_BINS, 0);
+	std::mutex mutex;
+	parallel_for_rows(0, img.rows, img.cols, [&](int i0, int i1) {
+		std::vector<int> part(HIST_WIDE_BINS, 0);
+		int lo = HIST_WIDE_BINS, hi = -1, rows = i1 - i0;
+		size_t n = img.cols;
+		if (img.isContinuous()) {
+			n *= rows;
+			rows = 1;
+		}
+		for (int i = i0; i < i0 + rows; i++) {
+			const ushort* p = img.ptr<ushort>(i);
+			for (size_t k = 0; k < n; k++) {
+				part[p[k]]++;
+				lo = std::min(lo, (int)p[k]);
+				hi = std::max(hi, (int)p[k]);
+			}
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int v = lo; v <= hi; v++) {
+			hist[v] += part[v];
+		}
+	}, opts);
+	return hist;
+}
+
+// histogram equalization of a CV_16UC1 src into dst, g(f) = 65535 * C(f) rounded
+static void hist_equalize_16u(const cv::Mat& src, cv::Mat& dst, const ParallelOptions& opts) {
+	std::vector<int> hist = count_hist_16u(src, opts);
+	std::vector<ushort> value(HIST_WIDE_BINS);
+	const long long max = HIST_WIDE_BINS - 1;
+	long long total = (long long)src.rows * src.cols, cum = 0;
+	for (int v = 0; v <= max; v++) {
+		cum += hist[v];
+		value[v] = (ushort)((2 * max * cum + total) / (2 * total));
+	}
+
+	parallel_for_rows(0, src.rows, src.cols, [&](int i0, int i1) {
+		for (int i = i0; i < i1; i++) {
+			const ushort* p = src.ptr<ushort>(i);
+			ushort* q = dst.ptr<ushort>(i);
+			for (int j = 0; j < src.cols; j++) {
+				q[j] = value[p[j]];
+			}
+		}
+	}, opts);
+}
+
+// bin of a float value between the min and max of the image, and how far into the bin it is
+static inline int hist_float_bin(float x, float min, float scale, float& frac) {
+	float t = (x - min) * scale;
+	int b = t > 0 ? std::min((int)t, HIST_WIDE_BINS - 1) : 0;
+	frac = t - b;
+	return b;
+}
+
+// histogram equalization of a CV_32FC1 src into dst with values min..max of src
+// values are binned between the min and max of src and C(f) is interpolated
+// linearly within a bin, so equal inputs stay equal and the mapping is continuous
+static void hist_equalize_32f(const cv::Mat& src, cv::Mat& dst, const ParallelOptions& opts) {
+	float min = FLT_MAX, max = -FLT_MAX;
+	std::mutex mutex;
+	parallel_for_rows(0, src.rows, src.cols, [&](int i0, int i1) {
+		float lo = FLT_MAX, hi = -FLT_MAX;
+		for (int i = i0; i < i1; i++) {
+			const float* p = src.ptr<float>(i);
+			for (int j = 0; j < src.cols; j++) {
+				lo = std::min(lo, p[j]);
+				hi = std::max(hi, p[j]);
+			}
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		min = std::min(min, lo);
+		max = std::max(max, hi);
+	}, opts);
+	if (!(max > min)) {
+		// one value only, which is all of C(f) and maps to max like for the other depths
+		dst = cv::Scalar::all(max);
+		return;
+	}
+
+	float scale = (float)(HIST_WIDE_BINS / ((double)max - min));
+	std::vector<int> hist(HIST_WIDE_BINS, 0);
+	parallel_for_rows(0, src.rows, src.cols, [&](int i0, int i1) {
+		std::vector<int> part(HIST_WIDE_BINS, 0);
+		for (int i = i0; i < i1; i++) {
+			const float* p = src.ptr<float>(i);
+			for (int j = 0; j < src.cols; j++) {
+				float frac;
+				part[hist_float_bin(p[j], min, scale, frac)]++;
+			}
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int v = 0; v < HIST_WIDE_BINS; v++) {
+			hist[v] += part[v];
+		}
+	}, opts);
+
+	// C(f) at the bottom of every bin and the rise over it
+	std::vector<float> base(HIST_WIDE_BINS), rise(HIST_WIDE_BINS);
+	double total = (double)src.rows * src.cols, cum = 0;
+	for (int v = 0; v < HIST_WIDE_BINS; v++) {
+		base[v] = (float)(cum / total);
+		rise[v] = (float)(hist[v] / total);
+		cum += hist[v];
+	}
+
+	// in double, max - min may not be a finite float
+	double range = (double)max - min;
+	parallel_for_rows(0, src.rows, src.cols, [&](int i0, int i1) {
+		for (int i = i0; i < i1; i++) {
+			const float* p = src.ptr<float>(i);
+			float* q = dst.ptr<float>(i);
+			for (int j = 0; j < src.cols; j++) {
+				float frac;
+				int b = hist_float_bin(p[j], min, scale, frac);
+				float c = std::min(base[b] + frac * rise[b], 1.0f);
+				q[j] = (float)std::min(min + range * c, (double)max);
+			}
+		}
+	}, opts);
+}
+
+// histogram equalization of src into dst
+void histogram_equalization_grey(const cv::Mat& src, cv::Mat& dst, HistLut* lut, const ParallelOptions& opts) {
+	if (src.type() != CV_8U && src.type() != CV_16U && src.type() != CV_32F) {
+		std::cout << "histogram_equalization_grey: img's type is not CV_8U, CV_16U or CV_32F\n";
+		return;
+	}
+	if (src.type() != CV_8U && lut) {
+		std::cout << "histogram_equalization_grey: lut is only for CV_8U\n";
+		return;
+	}
+	// create() keeps dst when it already fits, so in place and preallocated output need no copy
+	dst.create(src.rows, src.cols, src.type());
+	if (src.empty()) {
+		return;
+	}
+	if (src.type() == CV_16U) {
+		hist_equalize_16u(src, dst, opts);
+		return;
+	}
+	if (src.type() == CV_32F) {
+		hist_equalize_32f(src, dst, opts);
+		return;
+	}
+
+	if (lut && !lut->empty) {
+		// map through the table of the previous frame while counting this one
+		int hist[256] = {};
+		hist_map_parallel(src, dst, lut->value, hist, opts);
+		hist_equalization_lut(hist, lut->value);
+		return;
+	}
+
+	// count the times each grey value occurs, then calculate the mapping g from C(f)
+	HistLut own;
+	if (!lut) {
+		lut = &own;
+	}
+	hist_equalization_lut(count_hist_grey(src, opts).data(), lut->value);
+	lut->empty = false;
+	hist_map_parallel(src, dst, lut->value, nullptr, opts);
+}
+
+static double hist_now_ms() {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+TemporalEqualizer::TemporalEqualizer(const TemporalEqualizerOptions& opts) : opts(opts) {
+	reset();
+}
+
+void TemporalEqualizer::reset() {
+	lut.empty = true;
+	std::fill(smoothed, smoothed + 256, 0.0);
+	std::fill(built, built + 256, 0.0);
+	stat = TemporalEqualizerStats();
+}
+
+const TemporalEqualizerStats& TemporalEqualizer::stats() const {
+	return stat;
+}
+
+// equalize one frame
+void TemporalEqualizer::apply(const cv::Mat& src, cv::Mat& dst) {
+	if (src.type() != CV_8U) {
+		std::cout << "TemporalEqualizer::apply: img's type is not CV_8U\n";
+		return;
+	}
+	dst.create(src.rows, src.cols, CV_8U);
+	stat.count_ms = stat.update_ms = stat.map_ms = 0;
+	stat.rebuilt = false;
+	if (src.empty()) {
+		return;
+	}
+
+	// count, in single pass mode while mapping through the table as it is
+	int hist[256] = {};
+	double t = hist_now_ms();
+	bool mapped = opts.single_pass && !lut.empty;
+	if (mapped) {
+		hist_map_parallel(src, dst, lut.value, hist, opts);
+		stat.map_ms = hist_now_ms() - t;
+	}
+	else {
+		std::vector<int> counted = count_hist_grey(src, opts);
+		std::copy(counted.begin(), counted.end(), hist);
+		stat.count_ms = hist_now_ms() - t;
+	}
+
+	// smooth P(f) over the frames and measure how far it moved since the table was built
+	t = hist_now_ms();
+	double total = (double)src.rows * src.cols, alpha = lut.empty ? 1 : std::min(std::max(opts.alpha, 0.0), 1.0);
+	stat.distance = 0;
+	for (int v = 0; v < 256; v++) {
+		smoothed[v] += alpha * (hist[v] / total - smoothed[v]);
+		stat.distance += std::abs(smoothed[v] - built[v]);
+	}
+	if (lut.empty || stat.distance > opts.threshold) {
+		// the table is built from counts in 1 / 2^24, far finer than the 256 levels it maps to
+		int fixed[256];
+		for (int v = 0; v < 256; v++) {
+			fixed[v] = (int)(smoothed[v] * (1 << 24) + 0.5);
+		}
+		hist_equalization_lut(fixed, lut.value);
+		lut.empty = false;
+		std::copy(smoothed, smoothed + 256, built);
+		stat.distance = 0;
+		stat.rebuilt = true;
+		stat.rebuilds++;
+	}
+	stat.update_ms = hist_now_ms() - t;
+
+	if (!mapped) {
+		t = hist_now_ms();
+		hist_map_parallel(src, dst, lut.value, nullptr, opts);
+		stat.map_ms = hist_now_ms() - t;
+	}
+	stat.frames++;
+}
+
+// histogram equalization for grey scale image
+// CV_8U maps to 0..255 and CV_16U to 0..65535 through a table of all levels;
+// CV_32F is counted in 65536 bins between its min and max and maps back onto
+// them; dst gets the type of src
+cv::Mat histogram_equalization_grey(const cv::Mat& img, const ParallelOptions& opts) {
+	if (img.type() != CV_8U && img.type() != CV_16U && img.type() != CV_32F) {
+		std::cout << "histogram_equalization_grey: img's type is not CV_8U, CV_16U or CV_32F\n";
+		return img;
+	}
+
+	cv::Mat ret;
+	histogram_equalization_grey(img, ret, nullptr, opts);
+	return ret;
+}
+
+// write the bins of hist to path as one line of text: the number of bins, then the bins
+bool save_hist(const std::string& path, const std::vector<int>& hist) {
+	std::ofstream out(path);
+	out << hist.size();
+	for (int c : hist) {
+		out << ' ' << c;
+	}
+	out << '\n';
+	if (!out) {
+		std::cout << "save_hist: cannot write " << path << "\n";
+		return false;
+	}
+	return true;
+}
+
+// read bins written by save_hist
+std::vector<int> load_hist(const std::string& path) {
+	std::ifstream in(path);
+	size_t n = 0;
+	std::vector<int> hist;
+	if (in >> n && n <= HIST_WIDE_BINS) {
+		hist.resize(n);
+		for (size_t v = 0; v < n; v++) {
+			in >> hist[v];
+		}
+	}
+	if (!in || hist.empty()) {
+		std::cout << "load_hist: cannot read " << path << "\n";
+		return std::vector<int>();
+	}
+	return hist;
+}
+
+// histogram matching of src into dst
+void histogram_matching_grey(const cv::Mat& src, cv::Mat& dst, const std::vector<int>& ref_cdf, const ParallelOptions& opts) {
+	if (src.type() != CV_8U) {
+		std::cout << "histogram_matching_grey: img's type is not CV_8U\n";
+		return;
+	}
+	if (ref_cdf.size() != 256 || ref_cdf[0] < 0 || !std::is_sorted(ref_cdf.begin(), ref_cdf.end()) || ref_cdf[255] <= 0) {
+		std::cout << "histogram_matching_grey: ref_cdf is not a cumulative histogram of 256 bins\n";
+		return;
+	}
+	dst.create(src.rows, src.cols, CV_8U);
+	if (src.empty()) {
+		return;
+	}
+
+	// level f goes to the lowest g with C_ref(g) >= C(f); both run up with f, so one
+	// walk over the two CDFs finds all of them, compared as cross products of the
+	// counts so that images of any size compare exactly
+	std::vector<int> cdf = cumulative_hist(count_hist_grey(src, opts));
+	long long total = cdf[255], ref_total = ref_cdf[255];
+	uchar value[256];
+	int g = 0;
+	for (int f = 0; f < 256; f++) {
+		while (g < 255 && (long long)ref_cdf[g] * total < (long long)cdf[f] * ref_total) {
+			g++;
+		}
+		value[f] = (uchar)g;
+	}
+
+	hist_map_parallel(src, dst, value, nullptr, opts);
+}
+
+// histogram matching for grey scale image
+cv::Mat histogram_matching_grey(const cv::Mat& img, const std::vector<int>& ref_cdf, const ParallelOptions& opts) {
+	if (img.type() != CV_8U) {
+		std::cout << "histogram_matching_grey: img's type is not CV_8U\n";
+		return img;
+	}
+
+	// an invalid ref_cdf leaves ret empty
+	cv::Mat ret;
+	histogram_matching_grey(img, ret, ref_cdf, opts);
+	return ret.empty() ? img : ret;
+}
+
+cv::Mat histogram_matching_grey(const cv::Mat& img, const cv::Mat& ref, const ParallelOptions& opts) {
+	if (ref.type() != CV_8U) {
+		std::cout << "histogram_matching_grey: ref's type is not CV_8U\n";
+		return img;
+	}
+	return histogram_matching_grey(img, cumulative_hist(count_hist_grey(ref, opts)), opts);
+}
+
+// out = a + b for n bins of 8-bit counts that do not overflow
+static inline void hist_add_bins(const uchar* a, const uchar* b, uchar* out, int n) {
+	int k = 0;
+#if CV_SIMD128 && !defined(IPLIB_DISABLE_SIMD)
+	for (; k <= n - 16; k += 16) {
+		cv::v_store(out + k, cv::v_load(a + k) + cv::v_load(b + k));
+	}
+#endif
+	for (; k < n; k++) {
+		out[k] = (uchar)(a[k] + b[k]);
+	}
+}
+
+// rows and columns of the tiles of IntegralHistogram, small enough for the counts
+// within a tile, at most 15 * 15, to fit a byte
+const int HIST_INTEGRAL_TILE = 16;
+
+// the count of bin b of the pixels above and left of (y, x) is
+// top[Y][x][b] + part[y][X][b] + local[y][x][b] with Y = y / 16, X = x / 16:
+// top counts the rows above the tile row of y, part the columns of the tile row
+// left of the tile of x and local the rest, which is within one tile
+struct IntegralHistogram::Impl {
+	int rows, cols, bins, shift;
+	std::unique_ptr<unsigned[]> top, part;
+	std::unique_ptr<uchar[]> local;
+
+	// add sign times the counts above and left of (y, x) to hist
+	void corner(int y, int x, unsigned sign, unsigned* hist) const {
+		const int T = HIST_INTEGRAL_TILE;
+		const unsigned* t = &top[((size_t)(y / T) * (cols + 1) + x) * bins];
+		const unsigned* r = &part[((size_t)y * (cols / T + 1) + x / T) * bins];
+		const uchar* l = &local[((size_t)y * (cols + 1) + x) * bins];
+		for (int b = 0; b < bins; b++) {
+			hist[b] += sign * (t[b] + r[b] + l[b]);
+		}
+	}
+};
+
+IntegralHistogram::IntegralHistogram(const cv::Mat& img, int bins, const ParallelOptions& opts) {
+	if (img.type() != CV_8U) {
+		std::cout << "IntegralHistogram: img's type is not CV_8U\n";
+		return;
+	}
+	if (bins < 1 || bins > 256 || (bins & (bins - 1))) {
+		std::cout << "IntegralHistogram: bins is not a power of two up to 256\n";
+		return;
+	}
+	const int T = HIST_INTEGRAL_TILE;
+	std::shared_ptr<Impl> h = std::make_shared<Impl>();
+	int rows = h->rows = img.rows, cols = h->cols = img.cols;
+	h->bins = bins;
+	h->shift = 0;
+	while ((256 >> h->shift) > bins) {
+		h->shift++;
+	}
+	size_t row_bins = (size_t)(cols + 1) * bins, part_bins = (size_t)(cols / T + 1) * bins;
+	h->top.reset(new unsigned[(rows / T + 1) * row_bins]);
+	h->part.reset(new unsigned[(rows + 1) * part_bins]);
+	h->local.reset(new uchar[(rows + 1) * row_bins]);
+
+	// every tile row on its own, each row of counts is the one above plus the
+	// pixels of the row in between, which within a tile are at most 15 and are
+	// added to all bins of local at once; the tile row in full goes to top[Y + 1]
+	// and is summed up over the tile rows afterwards
+	std::fill(&h->top[0], &h->top[row_bins], 0u);
+	parallel_for_rows(0, rows / T + 1, cols * T, [&](int Y0, int Y1) {
+		std::vector<uchar> tile(bins), last_local(row_bins);
+		std::vector<unsigned> left(bins), last_part(part_bins);
+		// l and r of the row below row i from those above it
+		auto add_row = [&](int i, const uchar* l_above, uchar* l, const unsigned* r_above, unsigned* r) {
+			const uchar* p = img.ptr(i);
+			std::fill(left.begin(), left.end(), 0u);
+			for (int X = 0; X <= cols / T; X++) {
+				for (int b = 0; b < bins; b++) {
+					r[X * bins + b] = r_above[X * bins + b] + left[b];
+				}
+				std::fill(tile.begin(), tile.end(), 0);
+				for (int x = X * T; x < std::min(X * T + T, cols + 1); x++) {
+					hist_add_bins(l_above + x * bins, tile.data(), l + x * bins, bins);
+					if (x < cols) {
+						tile[p[x] >> h->shift]++;
+					}
+				}
+				for (int b = 0; b < bins; b++) {
+					left[b] += tile[b];
+				}
+			}
+		};
+		for (int Y = Y0; Y < Y1; Y++) {
+			int y0 = Y * T;
+			std::fill(&h->local[y0 * row_bins], &h->local[(y0 + 1) * row_bins], 0);
+			std::fill(&h->part[y0 * part_bins], &h->part[(y0 + 1) * part_bins], 0u);
+			for (int y = y0 + 1; y < y0 + T && y <= rows; y++) {
+				add_row(y - 1, &h->local[(y - 1) * row_bins], &h->local[y * row_bins],
+					&h->part[(y - 1) * part_bins], &h->part[y * part_bins]);
+			}
+			if (y0 + T <= rows) {
+				// the row below the tile row, within a tile at most 16 * 15 counts
+				add_row(y0 + T - 1, &h->local[(y0 + T - 1) * row_bins], last_local.data(),
+					&h->part[(y0 + T - 1) * part_bins], last_part.data());
+				unsigned* t = &h->top[(Y + 1) * row_bins];
+				for (int x = 0; x <= cols; x++) {
+					for (int b = 0; b < bins; b++) {
+						t[x * bins + b] = last_part[x / T * bins + b] + last_local[x * bins + b];
+					}
+				}
+			}
+		}
+	}, opts);
+	for (int Y = 1; Y <= rows / T; Y++) {
+		unsigned* t = &h->top[Y * row_bins];
+		const unsigned* above = t - row_bins;
+		for (size_t k = 0; k < row_bins; k++) {
+			t[k] += above[k];
+		}
+	}
+	impl = h;
+}
+
+bool IntegralHistogram::empty() const {
+	return !impl;
+}
+
+int IntegralHistogram::bins() const {
+	return impl ? impl->bins : 0;
+}
+
+cv::Size IntegralHistogram::size() const {
+	return impl ? cv::Size(impl->cols, impl->rows) : cv::Size();
+}
+
+size_t IntegralHistogram::table_bytes() const {
+	if (!impl) {
+		return 0;
+	}
+	const size_t T = HIST_INTEGRAL_TILE, rows = impl->rows, cols = impl->cols;
+	return ((rows / T + 1) * (cols + 1) + (rows + 1) * (cols / T + 1)) * impl->bins * sizeof(unsigned)
+		+ (rows + 1) * (cols + 1) * impl->bins;
+}
+
+// counts of the bins of the pixels in rect
+void IntegralHistogram::hist(cv::Rect rect, int* counts) const {
+	if (!impl) {
+		return;
+	}
+	std::vector<unsigned> sum(impl->bins, 0);
+	rect &= cv::Rect(0, 0, impl->cols, impl->rows);
+	if (rect.area() > 0) {
+		// the differences wrap around in unsigned, the sums are exact
+		impl->corner(rect.y + rect.height, rect.x + rect.width, 1, sum.data());
+		impl->corner(rect.y, rect.x + rect.width, (unsigned)-1, sum.data());
+		impl->corner(rect.y + rect.height, rect.x, (unsigned)-1, sum.data());
+		impl->corner(rect.y, rect.x, 1, sum.data());
+	}
+	for (int b = 0; b < impl->bins; b++) {
+		counts[b] = (int)sum[b];
+	}
+}
+
+std::vector<int> IntegralHistogram::hist(cv::Rect rect) const {
+	std::vector<int> counts(bins());
+	hist(rect, counts.data());
+	return counts;
+}
+
+// tiles of CLAHE along an axis of n pixels: count tiles of size pixels, the last
+// one may be shorter, tiles are never empty
+static void clahe_axis(int n, int tiles, int& size, int& count) {
+	tiles = std::max(1, std::min(tiles, n));
+	size = (n + tiles - 1) / tiles;
+	count = (n + size - 1) / size;
+}
+
+// pixel j lies between the centres of the tiles t0 - 1 and t0, i.e., t0 and
+// t0 + 1 of the grid with a border tile on each side, w is the weight of the
+// second one in 1 / WARP_INTER_SIZE
+static inline void clahe_interp(int j, int size, int& t0, int& w) {
+	int num = 2 * j + 1 + size, den = 2 * size;
+	t0 = num / den;
+	w = ((num % den) * WARP_INTER_SIZE + size) / den;
+}
+
+// clip the counts of hist to limit and spread the excess evenly over all levels
+static void clahe_clip(int hist[256], int limit) {
+	int excess = 0;
+	for (int v = 0; v < 256; v++) {
+		if (hist[v] > limit) {
+			excess += hist[v] - limit;
+			hist[v] = limit;
+		}
+	}
+	int batch = excess / 256, residual = excess % 256;
+	for (int v = 0; v < 256; v++) {
+		hist[v] += batch;
+	}
+	if (residual > 0) {
+		int step = std::max(256 / residual, 1);
+		for (int v = 0; v < 256 && residual > 0; v += step, residual--) {
+			hist[v]++;
+		}
+	}
+}
+
+// contrast limited adaptive histogram equalization of src into dst
+void clahe_grey(const cv::Mat& src, cv::Mat& dst, const ClaheOptions& opts) {
+	if (src.type() != CV_8U) {
+		std::cout << "clahe_grey: img's type is not CV_8U\n";
+		return;
+	}
+	dst.create(src.rows, src.cols, CV_8U);
+	if (src.empty()) {
+		return;
+	}
+	int rows = src.rows, cols = src.cols, th, ty, tw, tx;
+	clahe_axis(rows, opts.tiles_y, th, ty);
+	clahe_axis(cols, opts.tiles_x, tw, tx);
+
+	// count every tile, a band of rows counts the tile rows it crosses on its own
+	// and adds them up at the end of each of them, like count_hist_grey does
+	std::vector<int> hist((size_t)ty * tx * 256, 0);
+	std::mutex mutex;
+	parallel_for_rows(0, rows, cols, [&](int i0, int i1) {
+		std::vector<int> banks((size_t)tx * 4 * 256);
+		for (int i = i0; i < i1;) {
+			int t = i / th, end = std::min(i1, (t + 1) * th);
+			std::fill(banks.begin(), banks.end(), 0);
+			for (; i < end; i++) {
+				const uchar* p = src.ptr(i);
+				for (int k = 0; k < tx; k++) {
+					hist_count_banked(p + k * tw, std::min(tw, cols - k * tw), (int(*)[256])&banks[k * 4 * 256]);
+				}
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			for (int k = 0; k < tx; k++) {
+				const int* b = &banks[k * 4 * 256];
+				int* h = &hist[(t * tx + k) * 256];
+				for (int v = 0; v < 256; v++) {
+					h[v] += b[v] + b[v + 256] + b[v + 512] + b[v + 768];
+				}
+			}
+		}
+	}, opts);
+
+	// the table of every tile from its clipped counts, stored level by level with a
+	// border of replicated tiles around, so that the tables of the four tiles around
+	// a pixel are the 2x2 taps of a bilinear warp of that image
+	int sx = tx + 2, plane = (ty + 2) * sx;
+	std::vector<uchar> luts((size_t)256 * plane);
+	for (int t = 0; t < ty; t++) {
+		for (int k = 0; k < tx; k++) {
+			int* h = &hist[(t * tx + k) * 256];
+			int area = (std::min(th, rows - t * th)) * (std::min(tw, cols - k * tw));
+			if (opts.clip_limit > 0) {
+				clahe_clip(h, std::max(1, (int)(opts.clip_limit * area / 256)));
+			}
+			uchar value[256];
+			hist_equalization_lut(h, value);
+			for (int a = t == 0 ? 0 : t + 1; a <= (t == ty - 1 ? ty + 1 : t + 1); a++) {
+				for (int b = k == 0 ? 0 : k + 1; b <= (k == tx - 1 ? tx + 1 : k + 1); b++) {
+					for (int v = 0; v < 256; v++) {
+						luts[(size_t)v * plane + a * sx + b] = value[v];
+					}
+				}
+			}
+		}
+	}
+
+	// blend the four tables around every pixel through the gather kernel of PreparedWarp,
+	// a pixel of level v reads the taps of plane v
+	std::vector<int> x0(cols), wx(cols);
+	for (int j = 0; j < cols; j++) {
+		clahe_interp(j, tw, x0[j], wx[j]);
+	}
+	parallel_for_rows(0, rows, cols, [&](int i0, int i1) {
+		std::vector<int> ofs(cols);
+		std::vector<ushort> wts(cols);
+		for (int i = i0; i < i1; i++) {
+			int y0, fy;
+			clahe_interp(i, th, y0, fy);
+			const uchar* p = src.ptr(i);
+			for (int j = 0; j < cols; j++) {
+				ofs[j] = p[j] * plane + y0 * sx + x0[j];
+				wts[j] = (ushort)(wx[j] | fy << 8);
+			}
+			warp_table_row<uchar, 1>(luts.data(), sx, ofs.data(), wts.data(), dst.ptr(i), cols);
+		}
+	}, opts);
+}
+
+// contrast limited adaptive histogram equalization for grey scale image
+cv::Mat clahe_grey(const cv::Mat& img, const ClaheOptions& opts) {
+	if (img.type() != CV_8U) {
+		std::cout << "clahe_grey: img's type is not CV_8U\n";
+		return img;
+	}
+
+	cv::Mat ret;
+	clahe_grey(img, ret, opts);
+	return ret;
+}
+
+// rows of every plane of a PlanarImage start on multiples of this many bytes
+const size_t PLANAR_ALIGN = 64;
+
+void PlanarImage::create(int rows, int cols, int depth) {
+	if (!empty() && channels[0].rows == rows && channels[0].cols == cols && channels[0].depth() == depth) {
+		return;
+	}
+	size_t step = cv::alignSize(cols * CV_ELEM_SIZE1(depth), (int)PLANAR_ALIGN), plane = step * rows;
+	// a new buffer even if the old one is as large, copies may still hold its pixels
+	buffer.release();
+	buffer.create(1, (int)(3 * plane + PLANAR_ALIGN), CV_8U);
+	uchar* base = cv::alignPtr(buffer.data, (int)PLANAR_ALIGN);
+	for (int k = 0; k < 3; k++) {
+		channels[k] = cv::Mat(rows, cols, depth, base + k * plane, step);
+	}
+}
+
+bool PlanarImage::empty() const {
+	return channels[0].empty();
+}
+
+int PlanarImage::rows() const {
+	return channels[0].rows;
+}
+
+int PlanarImage::cols() const {
+	return channels[0].cols;
+}
+
+cv::Size PlanarImage::size() const {
+	return channels[0].size();
+}
+
+int PlanarImage::depth() const {
+	return channels[0].depth();
+}
+
+#if CV_SIMD128 && !defined(IPLIB_DISABLE_SIMD)
+// 16 pixels of 8-bit planes interleaved per iteration
+static inline int planar_interleave_simd(const uchar* a, const uchar* b, const uchar* c, uchar* dst, int n) {
+	int j = 0;
+	for (; j <= n - 16; j += 16) {
+		cv::v_store_interleave(dst + 3 * j, cv::v_load(a + j), cv::v_load(b + j), cv::v_load(c + j));
+	}
+	return j;
+}
+
+// 8 pixels of 16-bit planes interleaved per iteration
+static inline int planar_interleave_simd(const ushort* a, const ushort* b, const ushort* c, ushort* dst, int n) {
+	int j = 0;
+	for (; j <= n - 8; j += 8) {
+		cv::v_store_interleave(dst + 3 * j, cv::v_load(a + j), cv::v_load(b + j), cv::v_load(c + j));
+	}
+	return j;
+}
+
+// 4 pixels of float planes interleaved per iteration
+static inline int planar_interleave_simd(const float* a, const float* b, const float* c, float* dst, int n) {
+	int j = 0;
+	for (; j <= n - 4; j += 4) {
+		cv::v_store_interleave(dst + 3 * j, cv::v_load(a + j), cv::v_load(b + j), cv::v_load(c + j));
+	}
+	return j;
+}
+
+// 16 8-bit pixels deinterleaved to planes per iteration
+static inline int planar_deinterleave_simd(const uchar* src, uchar* a, uchar* b, uchar* c, int n) {
+	int j = 0;
+	for (; j <= n - 16; j += 16) {
+		cv::v_uint8x16 x, y, z;
+		cv::v_load_deinterleave(src + 3 * j, x, y, z);
+		cv::v_store(a + j, x);
+		cv::v_store(b + j, y);
+		cv::v_store(c + j, z);
+	}
+	return j;
+}
+
+// 8 16-bit pixels deinterleaved to planes per iteration
+static inline int planar_deinterleave_simd(const ushort* src, ushort* a, ushort* b, ushort* c, int n) {
+	int j = 0;
+	for (; j <= n - 8; j += 8) {
+		cv::v_uint16x8 x, y, z;
+		cv::v_load_deinterleave(src + 3 * j, x, y, z);
+		cv::v_store(a + j, x);
+		cv::v_store(b + j, y);
+		cv::v_store(c + j, z);
+	}
+	return j;
+}
+
+// 4 float pixels deinterleaved to planes per iteration
+static inline int planar_deinterleave_simd(const float* src, float* a, float* b, float* c, int n) {
+	int j = 0;
+	for (; j <= n - 4; j += 4) {
+		cv::v_float32x4 x, y, z;
+		cv::v_load_deinterleave(src + 3 * j, x, y, z);
+		cv::v_store(a + j, x);
+		cv::v_store(b + j, y);
+		cv::v_store(c + j, z);
+	}
+	return j;
+}
+#else
+template<typename T>
+static inline int planar_interleave_simd(const T*, const T*, const T*, T*, int) {
+	return 0;
+}
+template<typename T>
+static inline int planar_deinterleave_simd(const T*, T*, T*, T*, int) {
+	return 0;
+}
+#endif
+
+// n pixels of the planes a, b and c to dst
+template<typename T>
+static void planar_interleave(const T* a, const T* b, const T* c, T* dst, int n) {
+	int j = planar_interleave_simd(a, b, c, dst, n);
+	for (; j < n; j++) {
+		dst[3 * j] = a[j];
+		dst[3 * j + 1] = b[j];
+		dst[3 * j + 2] = c[j];
+	}
+}
+
+// n pixels of src to the planes a, b and c
+template<typename T>
+static void planar_deinterleave(const T* src, T* a, T* b, T* c, int n) {
+	int j = planar_deinterleave_simd(src, a, b, c, n);
+	for (; j < n; j++) {
+		a[j] = src[3 * j];
+		b[j] = src[3 * j + 1];
+		c[j] = src[3 * j + 2];
+	}
+}
+
+// row i of the planes of planar to or from row i of the interleaved img
+template<typename T>
+static void planar_row(const cv::Mat& img, const cv::Mat* planar, int i, bool split) {
+	if (split) {
+		planar_deinterleave(img.ptr<T>(i), (T*)planar[0].ptr<T>(i), (T*)planar[1].ptr<T>(i), (T*)planar[2].ptr<T>(i), img.cols);
+	}
+	else {
+		planar_interleave(planar[0].ptr<T>(i), planar[1].ptr<T>(i), planar[2].ptr<T>(i), (T*)img.ptr<T>(i), img.cols);
+	}
+}
+
+// split the interleaved img to planar or merge planar to img over the thread pool
+static void planar_convert(const cv::Mat& img, const cv::Mat* planar, bool split, const ParallelOptions& opts) {
+	parallel_for_rows(0, img.rows, img.cols, [&](int i0, int i1) {
+		for (int i = i0; i < i1; i++) {
+			if (img.depth() == CV_8U) {
+				planar_row<uchar>(img, planar, i, split);
+			}
+			else if (img.depth() == CV_16U) {
+				planar_row<ushort>(img, planar, i, split);
+			}
+			else {
+				planar_row<float>(img, planar, i, split);
+			}
+		}
+	}, opts);
+}
+
+// split a three channel image to the planes of dst
+void split_planar(const cv::Mat& src, PlanarImage& dst, const ParallelOptions& opts) {
+	int depth = src.depth();
+	if (src.channels() != 3 || (depth != CV_8U && depth != CV_16U && depth != CV_32F)) {
+		std::cout << "split_planar: img's not of three channels of CV_8U, CV_16U or CV_32F\n";
+		return;
+	}
+	dst.create(src.rows, src.cols, depth);
+	planar_convert(src, dst.planes(), true, opts);
+}
+
+// merge the planes of src to a three channel image
+void merge_planar(const PlanarImage& src, cv::Mat& dst, const ParallelOptions& opts) {
+	int depth = src.depth();
+	if (src.empty() || (depth != CV_8U && depth != CV_16U && depth != CV_32F)) {
+		std::cout << "merge_planar: img's empty or not of CV_8U, CV_16U or CV_32F\n";
+		return;
+	}
+	dst.create(src.rows(), src.cols(), CV_MAKETYPE(depth, 3));
+	planar_convert(dst, src.planes(), false, opts);
+}
+
+// the kernels below take a color image as one interleaved Mat when step is 3 or
+// as three planes of one size when step is 1, element j of channel k of row i is
+// then at color_row(...)[k] + j * step
+
+// true if img, as step says, is of depth
+static bool color_check(const cv::Mat* img, int step, int depth, const char* fn) {
+	if (step == 3) {
+		if (img[0].type() != CV_MAKETYPE(depth, 3)) {
+			std::cout << fn << ": img's not of three channels of the depth expected\n";
+			return false;
+		}
+		return true;
+	}
+	for (int k = 0; k < 3; k++) {
+		if (img[k].type() != depth || img[k].size() != img[0].size()) {
+			std::cout << fn << ": planes are not of one size and the depth expected\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+// allocate img, as step says, if it is not already of the size and depth
+static void color_create(cv::Mat* img, int step, cv::Size size, int depth) {
+	if (step == 3) {
+		img[0].create(size, CV_MAKETYPE(depth, 3));
+		return;
+	}
+	for (int k = 0; k < 3; k++) {
+		img[k].create(size, depth);
+	}
+}
+
+// the channels of row i of img, as step says
+static inline void color_row(const cv::Mat* img, int step, int i, uchar* c[3]) {
+	for (int k = 0; k < 3; k++) {
+		c[k] = step == 3 ? (uchar*)img[0].ptr(i) + k * img[0].elemSize1() : (uchar*)img[k].ptr(i);
+	}
+}
+
+// coefficients of acos(x) = sqrt(1 - x) * sum(HSI_ACOS[k] * x^k) for x in [0, 1],
+// Abramowitz and Stegun 4.4.46, off by at most 2e-8 before float rounding
+const float HSI_ACOS[8] = { 1.5707963050f, -0.2145988016f, 0.0889789874f, -0.0501743046f,
+	0.0308918810f, -0.0170881256f, 0.0066700901f, -0.0012624911f };
+const float HSI_PI = (float)M_PI, HSI_2PI = (float)(2 * M_PI);
+// 16-bit H is H * 65536 / 2pi, so that a full turn wraps around
+const float HSI_H_FIX = (float)(65536 / (2 * M_PI));
+// pixels converted at a time when the float HSI is only a step to the output
+const int HSI_CHUNK = 64;
+
+// acos of x in [-1, 1], acos(-x) = pi - acos(x)
+static inline float hsi_acos(float x) {
+	float a = std::abs(x), p = HSI_ACOS[7];
+	for (int k = 6; k >= 0; k--) {
+		p = p * a + HSI_ACOS[k];
+	}
+	p = p * std::sqrt(1 - a);
+	return x < 0 ? HSI_PI - p : p;
+}
+
+// H, S and I of one BGR pixel: I = sum / 765, S = 1 - 3 * min / sum and H the angle
+// acos((2r - g - b) / 2 / sqrt((r - g)^2 + (r - b)(g - b))), 2pi - it if g < b
+static inline void hsi_from_bgr(float b, float g, float r, float& H, float& S, float& I) {
+	float sum = b + g + r, rg = r - g, rb = r - b, gb = g - b;
+	// (rg^2 + rb^2 + gb^2) / 2, zero for grey only
+	float d = rg * rg + rb * gb;
+	I = sum * (1.f / 765);
+	if (d == 0) {
+		H = 0;
+		S = 0;
+		return;
+	}
+	float x = (rg + rb) / (2 * std::sqrt(d));
+	H = hsi_acos(std::min(std::max(x, -1.f), 1.f));
+	H = gb < 0 ? HSI_2PI - H : H;
+	S = 1 - 3 * std::min(std::min(b, g), r) / sum;
+}
+
+#if CV_SIMD128 && !defined(IPLIB_DISABLE_SIMD)
+// hsi_from_bgr of 4 pixels, the same operations in the same order
+static inline void hsi_from_bgr4(const cv::v_float32x4& b, const cv::v_float32x4& g, const cv::v_float32x4& r,
+	cv::v_float32x4& H, cv::v_float32x4& S, cv::v_float32x4& I) {
+	using namespace cv;
+	const v_float32x4 zero = v_setzero_f32(), one = v_setall_f32(1.f);
+	v_float32x4 sum = b + g + r, rg = r - g, rb = r - b, gb = g - b;
+	v_float32x4 d = rg * rg + rb * gb;
+	I = sum * v_setall_f32(1.f / 765);
+	v_float32x4 grey = d == zero;
+
+	v_float32x4 x = (rg + rb) / (v_setall_f32(2.f) * v_sqrt(d));
+	x = v_min(v_max(x, v_setall_f32(-1.f)), one);
+	v_float32x4 a = v_abs(x), p = v_setall_f32(HSI_ACOS[7]);
+	for (int k = 6; k >= 0; k--) {
+		p = p * a + v_setall_f32(HSI_ACOS[k]);
+	}
+	p = p * v_sqrt(one - a);
+	H = v_select(x < zero, v_setall_f32(HSI_PI) - p, p);
+	H = v_select(gb < zero, v_setall_f32(HSI_2PI) - H, H);
+	S = one - v_setall_f32(3.f) * v_min(v_min(b, g), r) / sum;
+	H = v_select(grey, zero, H);
+	S = v_select(grey, zero, S);
+}
+
+// the 16 bytes of a as 4 x 4 floats
+static inline void color_widen(const cv::v_uint8x16& a, cv::v_float32x4 f[4]) {
+	using namespace cv;
+	v_uint16x8 lo, hi;
+	v_uint32x4 q[4];
+	v_expand(a, lo, hi);
+	v_expand(lo, q[0], q[1]);
+	v_expand(hi, q[2], q[3]);
+	for (int m = 0; m < 4; m++) {
+		f[m] = v_cvt_f32(v_reinterpret_as_s32(q[m]));
+	}
+}
+
+// 16 pixels of the channels c of step at j, deinterleaved if step is 3
+static inline void color_load16(const uchar* const c[3], int step, int j, cv::v_uint8x16 c8[3]) {
+	if (step == 3) {
+		cv::v_load_deinterleave(c[0] + 3 * j, c8[0], c8[1], c8[2]);
+		return;
+	}
+	for (int k = 0; k < 3; k++) {
+		c8[k] = cv::v_load(c[k] + j);
+	}
+}
+
+// 16 pixels to the channels c of step at j, interleaved if step is 3
+static inline void color_store16(uchar* const c[3], int step, int j, const cv::v_uint8x16 c8[3]) {
+	if (step == 3) {
+		cv::v_store_interleave(c[0] + 3 * j, c8[0], c8[1], c8[2]);
+		return;
+	}
+	for (int k = 0; k < 3; k++) {
+		cv::v_store(c[k] + j, c8[k]);
+	}
+}
+
+// 16 pixels of hsi_from_bgr_row per iteration
+static inline int hsi_from_bgr_simd(const uchar* const bgr[3], int step, float* h, float* s, float* i, int n) {
+	using namespace cv;
+	int j = 0;
+	for (; j <= n - 16; j += 16) {
+		v_uint8x16 c8[3];
+		color_load16(bgr, step, j, c8);
+		v_float32x4 c[3][4];
+		for (int k = 0; k < 3; k++) {
+			color_widen(c8[k], c[k]);
+		}
+		for (int m = 0; m < 4; m++) {
+			v_float32x4 H, S, I;
+			hsi_from_bgr4(c[0][m], c[1][m], c[2][m], H, S, I);
+			v_store(h + j + 4 * m, H);
+			v_store(s + j + 4 * m, S);
+			v_store(i + j + 4 * m, I);
+		}
+	}
+	return j;
+}
+
+// 8 values of hsi_to_fixed per iteration
+static inline int hsi_to_fixed_simd(const float* v, float scale, ushort* out, int n) {
+	using namespace cv;
+	const v_float32x4 v_scale = v_setall_f32(scale);
+	const v_int32x4 mask = v_setall_s32(0xffff);
+	int j = 0;
+	for (; j <= n - 8; j += 8) {
+		v_int32x4 a = v_round(v_load(v + j) * v_scale) & mask, b = v_round(v_load(v + j + 4) * v_scale) & mask;
+		v_store(out + j, v_pack(v_reinterpret_as_u32(a), v_reinterpret_as_u32(b)));
+	}
+	return j;
+}
+#else
+static inline int hsi_from_bgr_simd(const uchar* const*, int, float*, float*, float*, int) {
+	return 0;
+}
+static inline int hsi_to_fixed_simd(const float*, float, ushort*, int) {
+	return 0;
+}
+#endif
+
+// H, S and I of n BGR pixels of the channels bgr of step to the planes h, s and i
+static void hsi_from_bgr_row(const uchar* const bgr[3], int step, float* h, float* s, float* i, int n) {
+	int j = hsi_from_bgr_simd(bgr, step, h, s, i, n);
+	for (; j < n; j++) {
+		hsi_from_bgr(bgr[0][step * j], bgr[1][step * j], bgr[2][step * j], h[j], s[j], i[j]);
+	}
+}
+
+// n values of v times scale, rounded and wrapped to 16 bits
+static void hsi_to_fixed(const float* v, float scale, ushort* out, int n) {
+	int j = hsi_to_fixed_simd(v, scale, out, n);
+	for (; j < n; j++) {
+		out[j] = (ushort)(cvRound(v[j] * scale) & 0xffff);
+	}
+}
+
+// convert n BGR pixels of the channels bgr of in_step to HSI of depth in the
+// planes out[0..2] when step is 1, or interleaved at out[0] when step is 3
+static void hsi_convert_row(const uchar* const bgr[3], int in_step, int depth, void* const out[3], int step, int n) {
+	if (depth == CV_32F && step == 1) {
+		hsi_from_bgr_row(bgr, in_step, (float*)out[0], (float*)out[1], (float*)out[2], n);
+		return;
+	}
+	float CV_DECL_ALIGNED(16) f[3][HSI_CHUNK];
+	ushort CV_DECL_ALIGNED(16) u[3][HSI_CHUNK];
+	for (int j = 0; j < n; j += HSI_CHUNK) {
+		int m = std::min(HSI_CHUNK, n - j);
+		const uchar* b[3] = { bgr[0] + in_step * j, bgr[1] + in_step * j, bgr[2] + in_step * j };
+		hsi_from_bgr_row(b, in_step, f[0], f[1], f[2], m);
+		if (depth == CV_32F) {
+			planar_interleave(f[0], f[1], f[2], (float*)out[0] + 3 * j, m);
+			continue;
+		}
+		for (int c = 0; c < 3; c++) {
+			hsi_to_fixed(f[c], c == 0 ? HSI_H_FIX : 65535.f, step == 1 ? (ushort*)out[c] + j : u[c], m);
+		}
+		if (step == 3) {
+			planar_interleave(u[0], u[1], u[2], (ushort*)out[0] + 3 * j, m);
+		}
+	}
+}
+
+// convert the 8-bit BGR src of src_step to HSI of depth in dst of dst_step
+static void hsi_convert(const cv::Mat* src, int src_step, cv::Mat* dst, int dst_step, int depth,
+	const ParallelOptions& opts) {
+	const char* fn = "convert_rgb_to_hsi";
+	if (!color_check(src, src_step, CV_8U, fn)) {
+		return;
+	}
+	if (depth != CV_32F && depth != CV_16U) {
+		std::cout << fn << ": depth is not CV_32F or CV_16U\n";
+		return;
+	}
+	cv::Size size = src[0].size();
+	color_create(dst, dst_step, size, depth);
+	parallel_for_rows(0, size.height, size.width, [&](int i0, int i1) {
+		for (int i = i0; i < i1; i++) {
+			uchar* in[3];
+			uchar* out[3];
+			color_row(src, src_step, i, in);
+			color_row(dst, dst_step, i, out);
+			void* const o[3] = { out[0], out[1], out[2] };
+			hsi_convert_row(in, src_step, depth, o, dst_step, size.width);
+		}
+	}, opts);
+}
+
+// convert a CV_8UC3 image to interleaved HSI
+void convert_rgb_to_hsi(const cv::Mat& src, cv::Mat& dst, int depth, const ParallelOptions& opts) {
+	hsi_convert(&src, 3, &dst, 3, depth, opts);
+}
+
+// convert a CV_8UC3 image to three HSI planes
+void convert_rgb_to_hsi(const cv::Mat& src, cv::Mat planes[3], int depth, const ParallelOptions& opts) {
+	hsi_convert(&src, 3, planes, 1, depth, opts);
+}
+
+// convert a CV_8UC3 image to planar HSI
+void convert_rgb_to_hsi(const cv::Mat& src, PlanarImage& dst, int depth, const ParallelOptions& opts) {
+	if (src.type() == CV_8UC3 && (depth == CV_32F || depth == CV_16U)) {
+		dst.create(src.rows, src.cols, depth);
+	}
+	hsi_convert(&src, 3, dst.planes(), 1, depth, opts);
+}
+
+// convert planar 8-bit BGR to planar HSI, dst may be src
+void convert_rgb_to_hsi(const PlanarImage& src, PlanarImage& dst, int depth, const ParallelOptions& opts) {
+	// keep the pixels of src should dst be src and reallocate
+	PlanarImage in = src;
+	if (in.depth() == CV_8U && (depth == CV_32F || depth == CV_16U)) {
+		dst.create(in.rows(), in.cols(), depth);
+	}
+	hsi_convert(in.planes(), 1, dst.planes(), 1, depth, opts);
+}
+
+// coefficients of cos(x) = sum(HSI_COS[k] * x^2k) and sin(x) = x * sum(HSI_SIN[k] * x^2k),
+// Taylor series to x^10 and x^11, off by at most 4e-9 for |x| <= pi/3
+const float HSI_COS[6] = { 1.f, -1.f / 2, 1.f / 24, -1.f / 720, 1.f / 40320, -1.f / 3628800 };
+const float HSI_SIN[6] = { 1.f, -1.f / 6, 1.f / 120, -1.f / 5040, 1.f / 362880, -1.f / 39916800 };
+const float HSI_PI3 = (float)(M_PI / 3), HSI_2PI3 = (float)(2 * M_PI / 3), HSI_4PI3 = (float)(4 * M_PI / 3);
+const float HSI_SQRT3_2 = (float)(0.5 * std::sqrt(3.0));
+
+// one BGR pixel of H, S and I, clamped to their ranges, the channels saturate to 0..255
+// in the sector of H the least channel is (1 - S) / 3 of the sum and the one of
+// the sector (1 + S * cos(h) / cos(pi/3 - h)) / 3, h the hue from the sector start
+static inline void bgr_from_hsi(float H, float S, float I, uchar* px) {
+	// written so that NaN clamps to 0
+	H = H > 0 ? std::min(H, HSI_2PI) : 0;
+	S = S > 0 ? std::min(S, 1.f) : 0;
+	I = I > 0 ? std::min(I, 1.f) : 0;
+	int sector = H < HSI_2PI3 ? 0 : H < HSI_4PI3 ? 1 : 2;
+	// x is the hue from the middle of the sector, in [-pi/3, pi/3], so that
+	// cos(h) / cos(pi/3 - h) = (cos(x) / 2 - sqrt(3) / 2 * sin(x)) / cos(x)
+	float x = H - (sector == 0 ? HSI_PI3 : sector == 1 ? HSI_PI3 + HSI_2PI3 : HSI_PI3 + HSI_4PI3);
+	float x2 = x * x, c = HSI_COS[5], sn = HSI_SIN[5];
+	for (int k = 4; k >= 0; k--) {
+		c = c * x2 + HSI_COS[k];
+		sn = sn * x2 + HSI_SIN[k];
+	}
+	sn = sn * x;
+	// the least channel, the one of the sector and the remaining one
+	float a = (1 - S) * (1.f / 3);
+	float m = (1 + S * (0.5f * c - HSI_SQRT3_2 * sn) / c) * (1.f / 3);
+	float rest = 1 - a - m;
+	float t = I * 765, b, g, r;
+	if (sector == 0) {
+		b = a, r = m, g = rest;
+	}
+	else if (sector == 1) {
+		r = a, g = m, b = rest;
+	}
+	else {
+		g = a, b = m, r = rest;
+	}
+	px[0] = (uchar)std::min(std::max(t * b, 0.f), 255.f);
+	px[1] = (uchar)std::min(std::max(t * g, 0.f), 255.f);
+	px[2] = (uchar)std::min(std::max(t * r, 0.f), 255.f);
+}
+
+#if CV_SIMD128 && !defined(IPLIB_DISABLE_SIMD)
+// bgr_from_hsi of 4 pixels, every sector evaluated and blended, truncated to int
+static inline void bgr_from_hsi4(cv::v_float32x4 H, cv::v_float32x4 S, cv::v_float32x4 I,
+	cv::v_int32x4& b, cv::v_int32x4& g, cv::v_int32x4& r) {
+	using namespace cv;
+	const v_float32x4 zero = v_setzero_f32(), one = v_setall_f32(1.f), third = v_setall_f32(1.f / 3);
+	// v_max gives its second argument for NaN
+	H = v_min(v_max(H, zero), v_setall_f32(HSI_2PI));
+	S = v_min(v_max(S, zero), one);
+	I = v_min(v_max(I, zero), one);
+	v_float32x4 s0 = H < v_setall_f32(HSI_2PI3), s1 = H < v_setall_f32(HSI_4PI3);
+	v_float32x4 x = H - v_select(s0, v_setall_f32(HSI_PI3),
+		v_select(s1, v_setall_f32(HSI_PI3 + HSI_2PI3), v_setall_f32(HSI_PI3 + HSI_4PI3)));
+
+	v_float32x4 x2 = x * x, c = v_setall_f32(HSI_COS[5]), sn = v_setall_f32(HSI_SIN[5]);
+	for (int k = 4; k >= 0; k--) {
+		c = c * x2 + v_setall_f32(HSI_COS[k]);
+		sn = sn * x2 + v_setall_f32(HSI_SIN[k]);
+	}
+	sn = sn * x;
+	v_float32x4 a = (one - S) * third;
+	v_float32x4 m = (one + S * (v_setall_f32(0.5f) * c - v_setall_f32(HSI_SQRT3_2) * sn) / c) * third;
+	v_float32x4 rest = one - a - m;
+	v_float32x4 t = I * v_setall_f32(765.f);
+	b = v_trunc(t * v_select(s0, a, v_select(s1, rest, m)));
+	g = v_trunc(t * v_select(s0, rest, v_select(s1, m, a)));
+	r = v_trunc(t * v_select(s0, m, v_select(s1, a, rest)));
+}
+
+// 16 pixels of bgr_from_hsi_row per iteration
+static inline int bgr_from_hsi_simd(const float* h, const float* s, const float* i, uchar* const bgr[3], int step, int n) {
+	using namespace cv;
+	int j = 0;
+	for (; j <= n - 16; j += 16) {
+		v_int32x4 c[3][4];
+		for (int m = 0; m < 4; m++) {
+			bgr_from_hsi4(v_load(h + j + 4 * m), v_load(s + j + 4 * m), v_load(i + j + 4 * m), c[0][m], c[1][m], c[2][m]);
+		}
+		// both packs saturate, so out of range channels clamp to 0..255
+		v_uint8x16 c8[3];
+		for (int k = 0; k < 3; k++) {
+			c8[k] = v_pack_u(v_pack(c[k][0], c[k][1]), v_pack(c[k][2], c[k][3]));
+		}
+		color_store16(bgr, step, j, c8);
+	}
+	return j;
+}
+
+// 8 values of hsi_from_fixed per iteration
+static inline int hsi_from_fixed_simd(const ushort* v, float scale, float* out, int n) {
+	using namespace cv;
+	const v_float32x4 v_scale = v_setall_f32(scale);
+	int j = 0;
+	for (; j <= n - 8; j += 8) {
+		v_uint32x4 a, b;
+		v_expand(v_load(v + j), a, b);
+		v_store(out + j, v_cvt_f32(v_reinterpret_as_s32(a)) * v_scale);
+		v_store(out + j + 4, v_cvt_f32(v_reinterpret_as_s32(b)) * v_scale);
+	}
+	return j;
+}
+#else
+static inline int bgr_from_hsi_simd(const float*, const float*, const float*, uchar* const*, int, int) {
+	return 0;
+}
+static inline int hsi_from_fixed_simd(const ushort*, float, float*, int) {
+	return 0;
+}
+#endif
+
+// n BGR pixels to the channels bgr of step of the planes h, s and i
+static void bgr_from_hsi_row(const float* h, const float* s, const float* i, uchar* const bgr[3], int step, int n) {
+	int j = bgr_from_hsi_simd(h, s, i, bgr, step, n);
+	for (; j < n; j++) {
+		uchar px[3];
+		bgr_from_hsi(h[j], s[j], i[j], px);
+		for (int k = 0; k < 3; k++) {
+			bgr[k][step * j] = px[k];
+		}
+	}
+}
+
+// n 16-bit values of v times scale
+static void hsi_from_fixed(const ushort* v, float scale, float* out, int n) {
+	int j = hsi_from_fixed_simd(v, scale, out, n);
+	for (; j < n; j++) {
+		out[j] = v[j] * scale;
+	}
+}
+
+// convert n HSI pixels of depth in the planes in[0..2] when step is 1, or
+// interleaved at in[0] when step is 3, to the channels bgr of out_step
+static void bgr_convert_row(const void* const in[3], int depth, int step, uchar* const bgr[3], int out_step, int n) {
+	if (depth == CV_32F && step == 1) {
+		bgr_from_hsi_row((const float*)in[0], (const float*)in[1], (const float*)in[2], bgr, out_step, n);
+		return;
+	}
+	float CV_DECL_ALIGNED(16) f[3][HSI_CHUNK];
+	ushort CV_DECL_ALIGNED(16) u[3][HSI_CHUNK];
+	for (int j = 0; j < n; j += HSI_CHUNK) {
+		int m = std::min(HSI_CHUNK, n - j);
+		if (depth == CV_32F) {
+			planar_deinterleave((const float*)in[0] + 3 * j, f[0], f[1], f[2], m);
+		}
+		else {
+			if (step == 3) {
+				planar_deinterleave((const ushort*)in[0] + 3 * j, u[0], u[1], u[2], m);
+			}
+			for (int c = 0; c < 3; c++) {
+				const ushort* v = step == 3 ? u[c] : (const ushort*)in[c] + j;
+				hsi_from_fixed(v, c == 0 ? 1 / HSI_H_FIX : 1 / 65535.f, f[c], m);
+			}
+		}
+		uchar* const b[3] = { bgr[0] + out_step * j, bgr[1] + out_step * j, bgr[2] + out_step * j };
+		bgr_from_hsi_row(f[0], f[1], f[2], b, out_step, m);
+	}
+}
+
+// convert HSI of convert_rgb_to_hsi in src of src_step to 8-bit BGR in dst of dst_step
+static void bgr_convert(const cv::Mat* src, int src_step, cv::Mat* dst, int dst_step, const ParallelOptions& opts) {
+	const char* fn = "convert_hsi_to_rgb";
+	int depth = src[0].depth();
+	if (depth != CV_32F && depth != CV_16U) {
+		std::cout << fn << ": img's not CV_32F or CV_16U\n";
+		return;
+	}
+	if (!color_check(src, src_step, depth, fn)) {
+		return;
+	}
+	cv::Size size = src[0].size();
+	color_create(dst, dst_step, size, CV_8U);
+	parallel_for_rows(0, size.height, size.width, [&](int i0, int i1) {
+		for (int i = i0; i < i1; i++) {
+			uchar* in[3];
+			uchar* out[3];
+			color_row(src, src_step, i, in);
+			color_row(dst, dst_step, i, out);
+			const void* const c[3] = { in[0], in[1], in[2] };
+			bgr_convert_row(c, depth, src_step, out, dst_step, size.width);
+		}
+	}, opts);
+}
+
+// convert interleaved HSI to a CV_8UC3 image
+void convert_hsi_to_rgb(const cv::Mat& src, cv::Mat& dst, const ParallelOptions& opts) {
+	bgr_convert(&src, 3, &dst, 3, opts);
+}
+
+// convert three HSI planes to a CV_8UC3 image
+void convert_hsi_to_rgb(const cv::Mat planes[3], cv::Mat& dst, const ParallelOptions& opts) {
+	bgr_convert(planes, 1, &dst, 3, opts);
+}
+
+// convert planar HSI to a CV_8UC3 image
+void convert_hsi_to_rgb(const PlanarImage& src, cv::Mat& dst, const ParallelOptions& opts) {
+	bgr_convert(src.planes(), 1, &dst, 3, opts);
+}
+
+// convert planar HSI to planar 8-bit BGR, dst may be src
+void convert_hsi_to_rgb(const PlanarImage& src, PlanarImage& dst, const ParallelOptions& opts) {
+	PlanarImage in = src;
+	int depth = in.depth();
+	if (!in.empty() && (depth == CV_32F || depth == CV_16U)) {
+		dst.create(in.rows(), in.cols(), CV_8U);
+	}
+	bgr_convert(in.planes(), 1, dst.planes(), 1, opts);
+}
+
+// tables kept by ColorLut::cached, e.g., a few gammas or white balances at 65^3
+const size_t COLOR_LUT_CACHE = 8;
+
+// the table holds BGR and a pad for every node, so that one node is one vector,
+// idx and frac give the node below each level and the position past it in 0..1
+struct ColorLut::Impl {
+	int size;
+	std::vector<float> table;
+	int idx[256];
+	float frac[256];
+};
+
+ColorLut::ColorLut(int size, const ColorFunction& fn, const ParallelOptions& opts) {
+	if (size < 2 || size > 256) {
+		std::cout << "ColorLut: size is not within 2..256\n";
+		return;
+	}
+	if (!fn) {
+		std::cout << "ColorLut: fn is empty\n";
+		return;
+	}
+	std::shared_ptr<Impl> t = std::make_shared<Impl>();
+	t->size = size;
+	t->table.resize((size_t)size * size * size * 4);
+	for (int c = 0; c < 256; c++) {
+		// level 255 is the far end of the last cell rather than a cell of its own
+		int pos = c * (size - 1);
+		t->idx[c] = std::min(pos / 255, size - 2);
+		t->frac[c] = (pos - t->idx[c] * 255) / 255.f;
+	}
+
+	// one plane of B per row of the pool
+	parallel_for_rows(0, size, size * size, [&](int b0, int b1) {
+		for (int b = b0; b < b1; b++) {
+			for (int g = 0; g < size; g++) {
+				for (int r = 0; r < size; r++) {
+					float in[3] = { b * 255.f / (size - 1), g * 255.f / (size - 1), r * 255.f / (size - 1) };
+					float* out = &t->table[(((size_t)b * size + g) * size + r) * 4];
+					fn(in, out);
+					out[3] = 0;
+				}
+			}
+		}
+	}, opts);
+	impl = t;
+}
+
+// the tables of ColorLut::cached by key and size, the one used last at the back
+static std::mutex color_lut_mutex;
+static std::vector<std::pair<std::string, ColorLut>> color_lut_cache;
+
+// the cached table of name made the most recent into lut, color_lut_mutex held
+static bool color_lut_find(const std::string& name, ColorLut& lut) {
+	auto& cache = color_lut_cache;
+	for (size_t k = 0; k < cache.size(); k++) {
+		if (cache[k].first == name) {
+			std::rotate(cache.begin() + k, cache.begin() + k + 1, cache.end());
+			lut = cache.back().second;
+			return true;
+		}
+	}
+	return false;
+}
+
+ColorLut ColorLut::cached(const std::string& key, int size, const ColorFunction& fn, const ParallelOptions& opts) {
+	std::string name = key + " @" + std::to_string(size);
+	ColorLut lut;
+	{
+		std::lock_guard<std::mutex> lock(color_lut_mutex);
+		if (color_lut_find(name, lut)) {
+			return lut;
+		}
+	}
+	// baked without the lock, the pool may be busy for a while
+	lut = ColorLut(size, fn, opts);
+	if (lut.empty()) {
+		return lut;
+	}
+	std::lock_guard<std::mutex> lock(color_lut_mutex);
+	// another thread may have baked the same table meanwhile, its copy is kept
+	if (color_lut_find(name, lut)) {
+		return lut;
+	}
+	color_lut_cache.emplace_back(name, lut);
+	if (color_lut_cache.size() > COLOR_LUT_CACHE) {
+		color_lut_cache.erase(color_lut_cache.begin());
+	}
+	return lut;
+}
+
+void ColorLut::clear_cache() {
+	std::lock_guard<std::mutex> lock(color_lut_mutex);
+	color_lut_cache.clear();
+}
+
+bool ColorLut::empty() const {
+	return !impl;
+}
+
+int ColorLut::size() const {
+	return impl ? impl->size : 0;
+}
+
+size_t ColorLut::table_bytes() const {
+	return impl ? impl->table.size() * sizeof(float) : 0;
+}
+
+// the cube of one pixel is cut into six tetrahedra along its diagonal, the one
+// holding the pixel is found by the order of the three fractions f1 >= f2 >= f3
+// and its corners are stepped to along the axes in that order, so that
+// out = (1 - f1) T0 + (f1 - f2) T1 + (f2 - f3) T2 + f3 T3
+static inline void color_lut_tetra(const int idx[256], const float frac[256], int size,
+	const uchar* px, int& base, int& o1, int& o2, float w[4]) {
+	const int sb = size * size * 4, sg = size * 4, sr = 4;
+	float fb = frac[px[0]], fg = frac[px[1]], fr = frac[px[2]], f1, f2, f3;
+	base = ((idx[px[0]] * size + idx[px[1]]) * size + idx[px[2]]) * 4;
+	if (fb >= fg) {
+		if (fg >= fr) {
+			f1 = fb, f2 = fg, f3 = fr, o1 = sb, o2 = sb + sg;
+		}
+		else if (fb >= fr) {
+			f1 = fb, f2 = fr, f3 = fg, o1 = sb, o2 = sb + sr;
+		}
+		else {
+			f1 = fr, f2 = fb, f3 = fg, o1 = sr, o2 = sr + sb;
+		}
+	}
+	else {
+		if (fb >= fr) {
+			f1 = fg, f2 = fb, f3 = fr, o1 = sg, o2 = sg + sb;
+		}
+		else if (fg >= fr) {
+			f1 = fg, f2 = fr, f3 = fb, o1 = sg, o2 = sg + sr;
+		}
+		else {
+			f1 = fr, f2 = fg, f3 = fb, o1 = sr, o2 = sr + sg;
+		}
+	}
+	w[0] = 1 - f1;
+	w[1] = f1 - f2;
+	w[2] = f2 - f3;
+	w[3] = f3;
+}
+
+#if CV_SIMD128 && !defined(IPLIB_DISABLE_SIMD)
+// color_lut_row with the BGR of a pixel in one vector, the four corners are four
+// loads and the blend four multiply-adds
+static inline int color_lut_simd(const float* T, const int idx[256], const float frac[256], int size,
+	const uchar* src, uchar* dst, int n) {
+	using namespace cv;
+	const int o3 = (size * size + size + 1) * 4;
+	int j = 0;
+	for (; j < n; j++) {
+		int base, o1, o2;
+		float w[4];
+		color_lut_tetra(idx, frac, size, src + 3 * j, base, o1, o2, w);
+		const float* c = T + base;
+		v_float32x4 out = v_load(c) * v_setall_f32(w[0]) + v_load(c + o1) * v_setall_f32(w[1]);
+		out = out + v_load(c + o2) * v_setall_f32(w[2]);
+		out = out + v_load(c + o3) * v_setall_f32(w[3]);
+		v_int32x4 q = v_round(out);
+		// both packs saturate, which clamps to 0..255
+		v_uint8x16 p = v_pack_u(v_pack(q, q), v_pack(q, q));
+		unsigned bgr = v_reinterpret_as_u32(p).get0();
+		memcpy(dst + 3 * j, &bgr, 3);
+	}
+	return j;
+}
+#else
+static inline int color_lut_simd(const float*, const int*, const float*, int, const uchar*, uchar*, int) {
+	return 0;
+}
+#endif
+
+// n pixels of src through the table T of size^3 nodes to dst, dst may be src
+static void color_lut_row(const float* T, const int idx[256], const float frac[256], int size,
+	const uchar* src, uchar* dst, int n) {
+	const int o3 = (size * size + size + 1) * 4;
+	int j = color_lut_simd(T, idx, frac, size, src, dst, n);
+	for (; j < n; j++) {
+		int base, o1, o2;
+		float w[4];
+		color_lut_tetra(idx, frac, size, src + 3 * j, base, o1, o2, w);
+		const float* c = T + base;
+		for (int k = 0; k < 3; k++) {
+			float out = c[k] * w[0] + c[o1 + k] * w[1];
+			out = out + c[o2 + k] * w[2];
+			out = out + c[o3 + k] * w[3];
+			dst[3 * j + k] = cv::saturate_cast<uchar>(cvRound(out));
+		}
+	}
+}
+
+void ColorLut::apply(const cv::Mat& src, cv::Mat& dst, const ParallelOptions& opts) const {
+	if (!impl) {
+		std::cout << "ColorLut::apply: the table is empty\n";
+		return;
+	}
+	if (src.type() != CV_8UC3) {
+		std::cout << "ColorLut::apply: img's not CV_8UC3\n";
+		return;
+	}
+	dst.create(src.rows, src.cols, CV_8UC3);
+	const Impl& t = *impl;
+	parallel_for_rows(0, src.rows, src.cols, [&](int i0, int i1) {
+		for (int i = i0; i < i1; i++) {
+			color_lut_row(t.table.data(), t.idx, t.frac, t.size, src.ptr(i), dst.ptr(i), src.cols);
+		}
+	}, opts);
+}
+
+cv::Mat ColorLut::apply(const cv::Mat& img, const ParallelOptions& opts) const {
+	cv::Mat ret;
+	apply(img, ret, opts);
+	return ret;
+}
+
+// the intensity of the CV_8UC3 img as levels 0..255, hsi_channels gets the
+// float hsi planes of img
+static cv::Mat hsi_intensity(const cv::Mat& img, cv::Mat hsi_channels[3], const ParallelOptions& opts) {
+	cv::Mat i_chan;
+	convert_rgb_to_hsi(img, hsi_channels, CV_32F, opts);
+	hsi_channels[2].convertTo(i_chan, CV_8U, 255);
+	return i_chan;
+}
+
+// rgb of hsi_channels with the intensity replaced by i_chan
+static cv::Mat hsi_replace_intensity(const cv::Mat& i_chan, cv::Mat hsi_channels[3], const ParallelOptions& opts) {
+	cv::Mat rgb;
+	i_chan.convertTo(hsi_channels[2], CV_32F, 1.0 / 255);
+	convert_hsi_to_rgb(hsi_channels, rgb, opts);
+	return rgb;
+}
+
+// plot histogram before and after transformation
+static void show_hist_before_after(const std::vector<int>& before, const std::vector<int>& after) {
+	cv::Mat hist[3], hist_out;
+	hist[0] = plot_hist_grey(before);
+	hist[1] = cv::Mat(hist_height, 10, CV_8UC3, cv::Scalar(144, 238, 144));
+	hist[2] = plot_hist_grey(after);
+	cv::hconcat(hist, 3, hist_out);
+	cv::imshow("hist out", hist_out);
+}
+
+// pixels of the fused color equalization handled at a time, their levels stay in L1
+const int HIST_GAIN_CHUNK = 1024;
+// 3 * v * c / sum is a multiple of 1 / sum, so when it is not a whole number it is
+// at least 1/765 below the next one; a bias below that and above the float error
+// makes the truncation that of the exact quotient
+const float HIST_GAIN_BIAS = 1.f / 2048;
+
+// one pixel of the intensity level v with the hue and saturation of px
+// the channels are scaled by I' / I = 3 * v / sum and saturate at 255, black,
+// which has no hue, becomes the grey of v as convert_hsi_to_rgb makes it
+static inline void hist_gain_pixel(const uchar* px, int v, uchar* out) {
+	int sum = px[0] + px[1] + px[2];
+	float c[3] = { (float)px[0], (float)px[1], (float)px[2] }, fs = (float)sum;
+	if (sum == 0) {
+		c[0] = c[1] = c[2] = 1;
+		fs = 3;
+	}
+	float g = (3 * v) / fs;
+	for (int k = 0; k < 3; k++) {
+		out[k] = (uchar)std::min((int)(c[k] * g + HIST_GAIN_BIAS), 255);
+	}
+}
+
+#if CV_SIMD128 && !defined(IPLIB_DISABLE_SIMD)
+// 16 pixels of hist_bgr_levels per iteration
+// (sum + 1) * 21846 >> 16 is (sum + 1) / 3 for every sum up to 765
+static inline int hist_bgr_levels_simd(const uchar* const bgr[3], int step, uchar* level, int n) {
+	using namespace cv;
+	const v_uint16x8 one = v_setall_u16(1), third = v_setall_u16(21846);
+	int j = 0;
+	for (; j <= n - 16; j += 16) {
+		v_uint8x16 c8[3];
+		color_load16(bgr, step, j, c8);
+		v_uint16x8 b0, b1, g0, g1, r0, r1;
+		v_expand(c8[0], b0, b1);
+		v_expand(c8[1], g0, g1);
+		v_expand(c8[2], r0, r1);
+		v_store(level + j, v_pack(v_mul_hi(b0 + g0 + r0 + one, third), v_mul_hi(b1 + g1 + r1 + one, third)));
+	}
+	return j;
+}
+
+// 16 pixels of hist_gain_row per iteration
+static inline int hist_gain_simd(const uchar* const bgr[3], int in_step, const uchar* level,
+	uchar* const out[3], int out_step, int n) {
+	using namespace cv;
+	const v_float32x4 zero = v_setzero_f32(), one = v_setall_f32(1.f), three = v_setall_f32(3.f);
+	const v_float32x4 bias = v_setall_f32(HIST_GAIN_BIAS);
+	int j = 0;
+	for (; j <= n - 16; j += 16) {
+		v_uint8x16 c8[3];
+		color_load16(bgr, in_step, j, c8);
+		v_float32x4 c[3][4], v[4];
+		for (int k = 0; k < 3; k++) {
+			color_widen(c8[k], c[k]);
+		}
+		color_widen(v_load(level + j), v);
+		v_int32x4 q[3][4];
+		for (int m = 0; m < 4; m++) {
+			v_float32x4 sum = c[0][m] + c[1][m] + c[2][m], black = sum == zero;
+			sum = v_select(black, three, sum);
+			v_float32x4 g = (three * v[m]) / sum;
+			for (int k = 0; k < 3; k++) {
+				q[k][m] = v_trunc(v_select(black, one, c[k][m]) * g + bias);
+			}
+		}
+		// both packs saturate, which clamps the channels to 255
+		for (int k = 0; k < 3; k++) {
+			c8[k] = v_pack_u(v_pack(q[k][0], q[k][1]), v_pack(q[k][2], q[k][3]));
+		}
+		color_store16(out, out_step, j, c8);
+	}
+	return j;
+}
+#else
+static inline int hist_bgr_levels_simd(const uchar* const*, int, uchar*, int) {
+	return 0;
+}
+static inline int hist_gain_simd(const uchar* const*, int, const uchar*, uchar* const*, int, int) {
+	return 0;
+}
+#endif
+
+// intensity levels of n BGR pixels of the channels bgr of step, round(sum / 3)
+// as hsi_intensity gives them, no sum is a tie
+static void hist_bgr_levels(const uchar* const bgr[3], int step, uchar* level, int n) {
+	int j = hist_bgr_levels_simd(bgr, step, level, n);
+	for (; j < n; j++) {
+		level[j] = (uchar)((bgr[0][step * j] + bgr[1][step * j] + bgr[2][step * j] + 1) / 3);
+	}
+}
+
+// n BGR pixels of the channels bgr of in_step given the levels level to the
+// channels out of out_step, out may be bgr
+static void hist_gain_row(const uchar* const bgr[3], int in_step, const uchar* level,
+	uchar* const out[3], int out_step, int n) {
+	int j = hist_gain_simd(bgr, in_step, level, out, out_step, n);
+	for (; j < n; j++) {
+		uchar px[3] = { bgr[0][in_step * j], bgr[1][in_step * j], bgr[2][in_step * j] }, q[3];
+		hist_gain_pixel(px, level[j], q);
+		for (int k = 0; k < 3; k++) {
+			out[k][out_step * j] = q[k];
+		}
+	}
+}
+
+// true if every Mat of img, as step says, is continuous
+static bool color_continuous(const cv::Mat* img, int step) {
+	for (int k = 0; k < (step == 3 ? 1 : 3); k++) {
+		if (!img[k].isContinuous()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// call body on runs of at most HIST_GAIN_CHUNK pixels of the rows [i0, i1) of src
+// and the same ones of dst if given, the rows are one run when both are continuous
+static void hist_bgr_runs(const cv::Mat* src, int src_step, cv::Mat* dst, int dst_step, int i0, int i1,
+	const std::function<void(const uchar* const*, uchar* const*, int)>& body) {
+	int rows = i1 - i0;
+	size_t n = src[0].cols;
+	if (color_continuous(src, src_step) && (!dst || color_continuous(dst, dst_step))) {
+		n *= rows;
+		rows = 1;
+	}
+	for (int i = i0; i < i0 + rows; i++) {
+		uchar* p[3];
+		uchar* q[3] = {};
+		color_row(src, src_step, i, p);
+		if (dst) {
+			color_row(dst, dst_step, i, q);
+		}
+		for (size_t k = 0; k < n; k += HIST_GAIN_CHUNK) {
+			const uchar* const in[3] = { p[0] + src_step * k, p[1] + src_step * k, p[2] + src_step * k };
+			uchar* const out[3] = { q[0] + dst_step * k, q[1] + dst_step * k, q[2] + dst_step * k };
+			body(in, dst ? out : nullptr, (int)std::min((size_t)HIST_GAIN_CHUNK, n - k));
+		}
+	}
+}
+
+// histogram equalization of the intensity of 8-bit BGR src of src_step to dst of
+// dst_step in two passes over BGR, with no HSI image: the levels round(sum / 3)
+// are counted, then every pixel is scaled to its equalized level
+static void hist_equalize_color_fused(const cv::Mat* src, int src_step, cv::Mat* dst, int dst_step,
+	const HistEqualizationOptions& opts) {
+	cv::Size size = src[0].size();
+	std::vector<int> hist_in(256, 0);
+	std::mutex mutex;
+	parallel_for_rows(0, size.height, size.width, [&](int i0, int i1) {
+		int part[256] = {};
+		uchar level[HIST_GAIN_CHUNK];
+		hist_bgr_runs(src, src_step, nullptr, 0, i0, i1, [&](const uchar* const* p, uchar* const*, int n) {
+			hist_bgr_levels(p, src_step, level, n);
+			hist_count_bytes(level, n, part);
+		});
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int v = 0; v < 256; v++) {
+			hist_in[v] += part[v];
+		}
+	}, opts);
+
+	uchar value[256];
+	hist_equalization_lut(hist_in.data(), value);
+	color_create(dst, dst_step, size, CV_8U);
+	parallel_for_rows(0, size.height, size.width, [&](int i0, int i1) {
+		uchar level[HIST_GAIN_CHUNK];
+		hist_bgr_runs(src, src_step, dst, dst_step, i0, i1, [&](const uchar* const* p, uchar* const* q, int n) {
+			hist_bgr_levels(p, src_step, level, n);
+			hist_map_bytes(level, level, n, value);
+			hist_gain_row(p, src_step, level, q, dst_step, n);
+		});
+	}, opts);
+
+	if (opts.show_hist) {
+		std::vector<int> hist_eq(256, 0);
+		for (int v = 0; v < 256; v++) {
+			hist_eq[value[v]] += hist_in[v];
+		}
+		show_hist_before_after(hist_in, hist_eq);
+	}
+}
+
+// histogram equalization for color image
+// algorithm: rgb->hsi->rgb
+// only support CV_8U depth now, i.e., 0..255
+cv::Mat histogram_equalization_color_hsi(const cv::Mat& img, const HistEqualizationOptions& opts) {
+	if (img.type() != CV_8UC3) {
+		std::cout << "histogram_equalization_color_hsi: img's not CV_8UC3\n";
+		return img;
+	}
+	if (opts.fused) {
+		cv::Mat ret;
+		hist_equalize_color_fused(&img, 3, &ret, 3, opts);
+		return ret;
+	}
+
+	// histogram equalization for I channel
+	cv::Mat hsi_channels[3];
+	cv::Mat i_chan = hsi_intensity(img, hsi_channels, opts);
+	std::vector<int> hist_in = count_hist_grey(i_chan, opts);
+	uchar value[256];
+	hist_equalization_lut(hist_in.data(), value);
+	hist_map_rows(i_chan, i_chan, 0, i_chan.rows, value, nullptr);
+
+	// every level v became value[v], so the counts after need no second pass over i_chan
+	if (opts.show_hist) {
+		std::vector<int> hist_eq(256, 0);
+		for (int v = 0; v < 256; v++) {
+			hist_eq[value[v]] += hist_in[v];
+		}
+		show_hist_before_after(hist_in, hist_eq);
+	}
+
+	return hsi_replace_intensity(i_chan, hsi_channels, opts);
+}
+
+// histogram equalization for color image into dst, in place if dst is src and
+// opts.fused
+void histogram_equalization_color_hsi(const cv::Mat& src, cv::Mat& dst, const HistEqualizationOptions& opts) {
+	if (src.type() != CV_8UC3) {
+		std::cout << "histogram_equalization_color_hsi: img's not CV_8UC3\n";
+		return;
+	}
+	if (opts.fused) {
+		hist_equalize_color_fused(&src, 3, &dst, 3, opts);
+	}
+	else {
+		dst = histogram_equalization_color_hsi(src, opts);
+	}
+}
+
+// histogram equalization for planar 8-bit BGR, always fused, dst may be src
+void histogram_equalization_color_hsi(const PlanarImage& src, PlanarImage& dst, const HistEqualizationOptions& opts) {
+	if (src.empty() || src.depth() != CV_8U) {
+		std::cout << "histogram_equalization_color_hsi: img's empty or not CV_8U\n";
+		return;
+	}
+	PlanarImage in = src;
+	dst.create(in.rows(), in.cols(), CV_8U);
+	hist_equalize_color_fused(in.planes(), 1, dst.planes(), 1, opts);
+}
+
+// contrast limited adaptive histogram equalization for color image
+cv::Mat clahe_color_hsi(const cv::Mat& img, const ClaheOptions& opts) {
+	if (img.type() != CV_8UC3) {
+		std::cout << "clahe_color_hsi: img's not CV_8UC3\n";
+		return img;
+	}
+
+	// the intensity levels, round(sum / 3), equalized as a grey image
+	cv::Mat level(img.rows, img.cols, CV_8U), level_eq;
+	parallel_for_rows(0, img.rows, img.cols, [&](int i0, int i1) {
+		for (int i = i0; i < i1; i++) {
+			uchar* p[3];
+			color_row(&img, 3, i, p);
+			hist_bgr_levels(p, 3, level.ptr(i), img.cols);
+		}
+	}, opts);
+	std::vector<int> hist_in;
+	if (opts.show_hist) {
+		hist_in = count_hist_grey(level, opts);
+	}
+	clahe_grey(level, level_eq, opts);
+	if (opts.show_hist) {
+		show_hist_before_after(hist_in, count_hist_grey(level_eq, opts));
+	}
+
+	// H and S are kept by scaling every pixel to its new level
+	cv::Mat ret(img.rows, img.cols, CV_8UC3);
+	parallel_for_rows(0, img.rows, img.cols, [&](int i0, int i1) {
+		for (int i = i0; i < i1; i++) {
+			uchar* p[3];
+			uchar* q[3];
+			color_row(&img, 3, i, p);
+			color_row(&ret, 3, i, q);
+			hist_gain_row(p, 3, level_eq.ptr(i), q, 3, img.cols);
+		}
+	}, opts);
+	return ret;
 }
 
 // create mosaic image beforehand
@@ -2,32 +2,477 @@
 
 #define _USE_MATH_DEFINES
 #include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <vector>
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
+#include "threadpool.h"
 
 const int hist_width = 512, hist_height = 420, bin_width = hist_width / 256;
 
+// how warpAffine walks dst in the general (bilinear) case
+enum WarpTraversal {
+	// tiles when rows are rotated enough to walk src diagonally, rows otherwise
+	WARP_TRAVERSE_AUTO,
+	// row-major, bands of rows per task
+	WARP_TRAVERSE_ROWS,
+	// tiles whose src footprint fits into L2
+	WARP_TRAVERSE_TILES
+};
+
+// interpolation of warpAffine
+enum WarpInterpolation {
+	// the nearest src pixel, for labels and masks
+	WARP_INTER_NEAREST,
+	// bilinear, 2x2 taps
+	WARP_INTER_LINEAR,
+	// bicubic, 4x4 taps
+	WARP_INTER_CUBIC,
+	// Lanczos-3, 6x6 taps
+	WARP_INTER_LANCZOS3
+};
+
+// options of warpAffine
+struct WarpOptions : ParallelOptions {
+	// one of WarpInterpolation
+	int interpolation = WARP_INTER_LINEAR;
+	// bilinear axis-aligned downscaling by 2 or more averages src over power of two
+	// boxes first instead of sampling 2x2 taps per dst pixel; alias-free, but every
+	// src pixel is read, so it is slower than sampling at small factors
+	bool antialias = false;
+	// one of WarpTraversal
+	int traversal = WARP_TRAVERSE_AUTO;
+	// tile size for WARP_TRAVERSE_TILES, 0 picks it from M and the pixel size
+	// grain is not used by the tile traversal
+	int tile_rows = 0, tile_cols = 0;
+};
+
 // Applies an affine transformation to an image.
 //
-// no flags, default to INTER_LINEAR, i.e., bilinear interpolation
+// opts.interpolation picks nearest, bilinear (the default), bicubic or Lanczos-3,
+// taps of the last two outside of src are replaced by the nearest border pixel
+// bilinear axis-aligned downscaling by 2 or more box-filters src first when
+// opts.antialias is set
+// src is 8U, 16U or 32F with 1, 3 or 4 channels, dst gets the type of src
 // M.type() must be CV_64FC1
-void warpAffine(const cv::Mat&, cv::Mat&, const cv::Mat&, cv::Size&);
+// dst is dsize when given, otherwise the bounding box of the transformed src
+// whose top-left corner becomes (0, 0), M's translation is then dropped
+// dst may be src or share its pixels, src is then copied first
+// source coordinates are stepped in 16.16 fixed point, so src must be smaller than 32768x32768
+// rows (tiles for rotations) are spread over the thread pool as opts says,
+// the result does not depend on the number of threads nor on the traversal
+void warpAffine(const cv::Mat&, cv::Mat&, const cv::Mat&, cv::Size&, const WarpOptions& opts = WarpOptions());
+
+// Applies a perspective transformation (homography) to an image, e.g., to rectify
+// a photographed document.
+//
+// M.type() must be CV_64FC1 and M must be 3x3, src, opts and the interpolations
+// are those of warpAffine
+// dst is dsize when given, otherwise the bounding box of the transformed src like
+// for warpAffine, which needs every corner of src in front of the camera
+// dst may be src or share its pixels like for warpAffine
+// along a dst row the src coordinates are computed exactly every few pixels and
+// stepped linearly in between, off by less than 1/256 pixel; an M whose last row
+// is (0, 0, w) is warped by warpAffine
+void warpPerspective(const cv::Mat&, cv::Mat&, const cv::Mat&, cv::Size&, const WarpOptions& opts = WarpOptions());
+
+// An affine warp prepared once for frames of one size and type, e.g., to rectify
+// a camera stream: apply() gives the same dst as warpAffine with the same M and dsize.
+//
+// in the general (rotated or sheared) case the source offset and packed 8-bit
+// bilinear weights of every dst pixel are tabulated up front (6 bytes per pixel),
+// so apply() only gathers; when the table would exceed max_bytes, only the valid
+// span of each dst row is kept and rows are stepped from M like warpAffine does
+// the other cases already have dedicated kernels and need no table, and so do
+// interpolations other than bilinear, which step their rows like warpAffine
+// apply() is const and the tables are shared by copies, so one object can serve
+// any number of threads
+class PreparedWarp {
+public:
+	PreparedWarp() {}
+	PreparedWarp(const cv::Mat& M, cv::Size src_size, int type, cv::Size dsize = cv::Size(),
+		size_t max_bytes = 64 << 20);
+
+	// true if preparing failed or the object is default constructed
+	bool empty() const;
+	// size of dst
+	cv::Size size() const;
+	// true if rows are stepped instead of read from a table
+	bool compressed() const;
+	// memory held by the tables
+	size_t table_bytes() const;
+
+	// warp one frame of the prepared size and type, dst may be src
+	void apply(const cv::Mat& src, cv::Mat& dst, const WarpOptions& opts = WarpOptions()) const;
+
+private:
+	struct Impl;
+	std::shared_ptr<const Impl> impl;
+};
+
+// fills rows, allocated by warpAffineStream, in place with src rows [y, y + rows.rows)
+// return false to stop the warp
+typedef std::function<bool(int y, cv::Mat& rows)> WarpRowReader;
+// takes dst rows [i, i + rows.rows), rows is reused for the next ones
+// return false to stop the warp
+typedef std::function<bool(int i, const cv::Mat& rows)> WarpRowWriter;
+
+// options of warpAffineStream
+struct WarpStreamOptions : WarpOptions {
+	// memory for the src window, the dst strip and the box reduced window together
+	size_t max_bytes = 256 << 20;
+	// dst rows per strip, 0 gives the strip a quarter of max_bytes
+	int strip_rows = 0;
+};
+
+// warpAffine for images too large to be held in memory, e.g., scanned maps:
+// src of src_size and type is read by reader as strips of rows and dst is handed
+// to writer strip by strip from top to bottom, the pixels are those of warpAffine.
+//
+// every dst strip keeps only the src rows it reads, rows shared with the previous
+// strip are not read again, so a deskew or downscale reads every src row once;
+// strips are shortened until their window fits opts.max_bytes and single rows
+// that still do not, e.g., of 90 degree rotations, are done in pieces, which
+// reads the src rows again for every piece
+// dsize is set to the size of dst, the rest of the arguments are those of warpAffine
+// returns false if the arguments are invalid, max_bytes is too small or
+// reader or writer stopped
+bool warpAffineStream(cv::Size src_size, int type, const WarpRowReader& reader, const cv::Mat& M, cv::Size& dsize,
+	const WarpRowWriter& writer, const WarpStreamOptions& opts = WarpStreamOptions());
+
+// count the times each grey level occurs in a CV_8UC1 image
+// return the 256 raw counts, which every histogram function here builds on
+// the pixels are counted into interleaved sub-histograms, so that runs of one
+// level do not serialize on one counter, and large images are split over the
+// thread pool as opts says
+std::vector<int> count_hist_grey(const cv::Mat&, const ParallelOptions& opts = ParallelOptions());
+
+// count the times each level occurs in every channel of a CV_8UC3 image in one
+// pass over the interleaved pixels, without splitting the planes
+// return 3 * 256 raw counts, those of channel c at [256 * c, 256 * c + 256) in
+// the order of the image, i.e., B, G, R; counted like count_hist_grey
+std::vector<int> count_hist_color(const cv::Mat&, const ParallelOptions& opts = ParallelOptions());
+
+// count the pixels of a CV_8UC3 image in a joint 3-D histogram, every channel
+// quantized to bins, a power of two up to 64, level v to bin v * bins / 256
+// return bins^3 raw counts, pixel (c0, c1, c2) at (c0 * bins + c1) * bins + c2,
+// or none if the arguments are invalid
+std::vector<int> count_hist_joint(const cv::Mat&, int bins = 16, const ParallelOptions& opts = ParallelOptions());
+
+// running sums of the counts of count_hist_grey, the last one is the pixel count
+std::vector<int> cumulative_hist(const std::vector<int>&);
+
+// the counts of count_hist_grey divided by the pixel count, i.e., P(f), or if
+// cumulative the running sums of those, i.e., C(f)
+std::vector<double> normalize_hist(const std::vector<int>&, bool cumulative = false);
+
+// plot the counts of count_hist_grey, scaled to the highest one
+// nothing is drawn until this is called, so count first and plot only what is shown
+// return a Mat that can be directly plotted
+cv::Mat plot_hist_grey(const std::vector<int>&);
 
 // calculate the histogram of a grey scale image
+// same as plot_hist_grey(count_hist_grey(img))
 // return a Mat that can be directly plotted
 cv::Mat cal_hist_grey(const cv::Mat&);
 
+// options of the histogram equalizations
+struct HistEqualizationOptions : ParallelOptions {
+	// show the histograms before and after in a window, batch callers turn this off
+	bool show_hist = true;
+	// histogram_equalization_color_hsi only: equalize in two passes over BGR, see there
+	bool fused = false;
+};
+
 // histogram equalization for grey scale image
-// only support CV_8U type now, i.e., 0..255
-cv::Mat histogram_equalization_grey(const cv::Mat&);
+// CV_8U maps to 0..255 and CV_16U, e.g., 12-bit sensor data, to 0..65535 through
+// a table of all levels; CV_32F is counted in 65536 bins between its min and max
+// and maps back onto min..max, so data in 0..4095 or 0..1 keeps its scale,
+// interpolating C(f) within a bin, its values must be finite; dst gets the type of src
+// never plots, the caller has the image before and after to count if needed
+cv::Mat histogram_equalization_grey(const cv::Mat&, const ParallelOptions& opts = ParallelOptions());
+
+// the mapping of histogram equalization, 255 * C(f) rounded, kept between the
+// frames of a video
+struct HistLut {
+	uchar value[256];
+	// true until a frame has been equalized with it
+	bool empty = true;
+};
+
+// histogram equalization of the CV_8UC1, CV_16UC1 or CV_32FC1 src into dst for
+// video frames
+//
+// dst may be src and is only allocated when it does not have the size and type of src
+// without lut this is histogram_equalization_grey: src is counted, then mapped
+// with lut, which is for CV_8UC1 only, an empty one is filled in from src the same way; a filled one maps
+// src as it is counted in a single pass, i.e., frame N gets the table of frame
+// N - 1, and is then replaced by the table of src for the next frame
+void histogram_equalization_grey(const cv::Mat& src, cv::Mat& dst, HistLut* lut = nullptr,
+	const ParallelOptions& opts = ParallelOptions());
+
+// a three channel image, BGR or HSI, as three planes of CV_8U, CV_16U or CV_32F
+//
+// every row of every plane starts on a 64-byte boundary and is padded to a
+// multiple of 64 bytes, so the color kernels load whole vectors from each plane
+// with no deinterleaving; copies share the pixels as cv::Mat does
+class PlanarImage {
+public:
+	PlanarImage() {}
+	PlanarImage(int rows, int cols, int depth) { create(rows, cols, depth); }
+
+	// allocate the planes, nothing is done if they already have the size and depth
+	void create(int rows, int cols, int depth);
+	bool empty() const;
+	int rows() const;
+	int cols() const;
+	cv::Size size() const;
+	int depth() const;
+	cv::Mat& plane(int k) { return channels[k]; }
+	const cv::Mat& plane(int k) const { return channels[k]; }
+	cv::Mat* planes() { return channels; }
+	const cv::Mat* planes() const { return channels; }
+
+private:
+	// one allocation for the three planes, aligned within it
+	cv::Mat buffer;
+	cv::Mat channels[3];
+};
+
+// split an interleaved three channel image of CV_8U, CV_16U or CV_32F into the
+// planes of dst and merge them back, 16 bytes per vector with 128-bit SIMD
+void split_planar(const cv::Mat& src, PlanarImage& dst, const ParallelOptions& opts = ParallelOptions());
+void merge_planar(const PlanarImage& src, cv::Mat& dst, const ParallelOptions& opts = ParallelOptions());
+
+// convert a CV_8UC3 (BGR) image to HSI, interleaved into dst or into three planes
+// or into a PlanarImage, whose source may be planar 8-bit BGR too
+//
+// depth CV_32F gives H in radians 0..2pi and S and I 0..1, those of the HSI used by
+// histogram_equalization_color_hsi; CV_16U gives H * 65536 / 2pi, wrapped to 16 bits,
+// and S and I * 65535, rounded
+// acos is a polynomial of Abramowitz and Stegun times a square root, H is within
+// 2e-5 of the exact one for every 8-bit color and S and I within 1e-7; 16 pixels
+// are converted per iteration with 128-bit SIMD, the scalar path gives the same
+// floats; rows are spread over the thread pool as opts says
+void convert_rgb_to_hsi(const cv::Mat& src, cv::Mat& dst, int depth = CV_32F,
+	const ParallelOptions& opts = ParallelOptions());
+void convert_rgb_to_hsi(const cv::Mat& src, cv::Mat planes[3], int depth = CV_32F,
+	const ParallelOptions& opts = ParallelOptions());
+void convert_rgb_to_hsi(const cv::Mat& src, PlanarImage& dst, int depth = CV_32F,
+	const ParallelOptions& opts = ParallelOptions());
+void convert_rgb_to_hsi(const PlanarImage& src, PlanarImage& dst, int depth = CV_32F,
+	const ParallelOptions& opts = ParallelOptions());
+
+// convert HSI as convert_rgb_to_hsi gives it, interleaved in src or in three
+// planes, to a CV_8UC3 (BGR) image or to planar 8-bit BGR
+//
+// H, S and I out of range are clamped and the channels saturate to 0..255, cos is
+// a polynomial and the three hue sectors are blended, 16 pixels per iteration
+void convert_hsi_to_rgb(const cv::Mat& src, cv::Mat& dst, const ParallelOptions& opts = ParallelOptions());
+void convert_hsi_to_rgb(const cv::Mat planes[3], cv::Mat& dst, const ParallelOptions& opts = ParallelOptions());
+void convert_hsi_to_rgb(const PlanarImage& src, cv::Mat& dst, const ParallelOptions& opts = ParallelOptions());
+void convert_hsi_to_rgb(const PlanarImage& src, PlanarImage& dst, const ParallelOptions& opts = ParallelOptions());
+
+// a per-pixel color function for ColorLut: out gets the BGR, 0..255, of the BGR in
+typedef std::function<void(const float in[3], float out[3])> ColorFunction;
+
+// 3-D color lookup table: a color function sampled on size^3 nodes spread evenly
+// over the BGR cube, e.g., 17, 33 or 65, and applied to CV_8UC3 images with
+// tetrahedral interpolation, so that a chain of color operations, e.g., a white
+// balance, a gamma and the gains of an equalization, is one pass over the image
+// and fn is called only at the nodes
+// a node is four floats, BGR and a pad, 16 bytes: 33^3 takes 0.6 MB and 65^3 4.4 MB;
+// the four corners of a pixel are blended as vectors of BGR with 128-bit SIMD and
+// output is rounded and saturated to 0..255
+// baking calls fn from the threads of the pool, it must be safe to call so;
+// the table is shared by copies and apply is const (see bench color-lut)
+class ColorLut {
+public:
+	ColorLut() {}
+	ColorLut(int size, const ColorFunction& fn, const ParallelOptions& opts = ParallelOptions());
+
+	// the table of fn at size baked before under key, or baked now and kept if
+	// there is none; key must tell fn and all its parameters apart, e.g.,
+	// "gamma 2.2"; the 8 tables used last are kept, threads missing the same key
+	// at once may each bake it but all get the one that is kept
+	static ColorLut cached(const std::string& key, int size, const ColorFunction& fn,
+		const ParallelOptions& opts = ParallelOptions());
+	static void clear_cache();
+
+	// true if baking failed or the object is default constructed
+	bool empty() const;
+	int size() const;
+	size_t table_bytes() const;
+
+	// dst may be src
+	void apply(const cv::Mat& src, cv::Mat& dst, const ParallelOptions& opts = ParallelOptions()) const;
+	cv::Mat apply(const cv::Mat& img, const ParallelOptions& opts = ParallelOptions()) const;
+
+private:
+	struct Impl;
+	std::shared_ptr<const Impl> impl;
+};
 
 // histogram equalization for color image
-// algorithm: rgb->hsi->rgb
+// algorithm: rgb->hsi->rgb, float32 planes of convert_rgb_to_hsi and back with
+// convert_hsi_to_rgb, whose channels saturate at 255
 // only support CV_8U depth now, i.e., 0..255
-cv::Mat histogram_equalization_color_hsi(const cv::Mat&);
+// the histograms of the intensity before and after are shown as "hist out" if opts.show_hist
+//
+// with opts.fused no HSI image is made: as H and S are kept, changing I to I' is
+// scaling the BGR of the pixel by I' / I, so the intensity levels are counted from
+// the channel sums and every pixel is then scaled by its gain, clamped to 255, in
+// a second pass, over the thread pool and 16 pixels per SIMD iteration; the result
+// is within 1 of the HSI round trip wherever that does not overflow 255
+cv::Mat histogram_equalization_color_hsi(const cv::Mat&, const HistEqualizationOptions& opts = HistEqualizationOptions());
+void histogram_equalization_color_hsi(const cv::Mat& src, cv::Mat& dst,
+	const HistEqualizationOptions& opts = HistEqualizationOptions());
+// planar 8-bit BGR is always equalized as opts.fused does it, dst may be src
+void histogram_equalization_color_hsi(const PlanarImage& src, PlanarImage& dst,
+	const HistEqualizationOptions& opts = HistEqualizationOptions());
+
+// write the bins of a histogram, e.g., a reference CDF for histogram_matching_grey,
+// to a text file so that batch workers load it instead of counting the reference
+// again; return false if the file cannot be written
+bool save_hist(const std::string& path, const std::vector<int>&);
+// read bins written by save_hist, empty if the file cannot be read
+std::vector<int> load_hist(const std::string& path);
+
+// histogram matching (specification) for grey scale image: maps the CV_8UC1 img so
+// that its histogram follows the one of a reference, e.g., to normalize scans to
+// a reference look
+//
+// ref_cdf is cumulative_hist(count_hist_grey(ref)) of the reference, which may have
+// any size; level f goes to the lowest level g with C_ref(g) >= C(f)
+// dst may be src and is only allocated when it does not have the size and type of src
+void histogram_matching_grey(const cv::Mat& src, cv::Mat& dst, const std::vector<int>& ref_cdf,
+	const ParallelOptions& opts = ParallelOptions());
+cv::Mat histogram_matching_grey(const cv::Mat&, const std::vector<int>& ref_cdf, const ParallelOptions& opts = ParallelOptions());
+// same with the CDF counted from the CV_8UC1 ref
+cv::Mat histogram_matching_grey(const cv::Mat&, const cv::Mat& ref, const ParallelOptions& opts = ParallelOptions());
+
+// Integral histogram of a CV_8UC1 image: the histogram of any rectangle in
+// O(bins), e.g., of the region under the mouse or of the many regions of CLAHE-like tools.
+//
+// levels are quantized to bins, a power of two up to 256, level v counts into bin
+// v * bins / 256; the counts above and left of every pixel are kept in tiles of
+// 16x16 pixels, 32-bit at the tile rows and columns and 8-bit within a tile,
+// i.e., about 1.5 bytes per pixel and bin instead of the 4 of a plain integral
+// image of 32-bit counts: a 20 MP image takes 0.5 GB with 16 bins, 1 GB with 32
+// and 2 GB with 64; building writes all of it once, which takes about 0.5 s per
+// 16 bins on one core, tile rows are spread over the thread pool as opts says
+// (see bench integral-hist)
+// the table is shared by copies and queries are const, so one object can serve
+// any number of threads
+class IntegralHistogram {
+public:
+	IntegralHistogram() {}
+	IntegralHistogram(const cv::Mat& img, int bins = 16, const ParallelOptions& opts = ParallelOptions());
+
+	// true if building failed or the object is default constructed
+	bool empty() const;
+	int bins() const;
+	// size of the image
+	cv::Size size() const;
+	// memory held by the tables
+	size_t table_bytes() const;
+
+	// counts of the bins of the pixels in rect, which is clipped to the image
+	void hist(cv::Rect rect, int* counts) const;
+	std::vector<int> hist(cv::Rect rect) const;
+
+private:
+	struct Impl;
+	std::shared_ptr<const Impl> impl;
+};
+
+// options of TemporalEqualizer
+struct TemporalEqualizerOptions : ParallelOptions {
+	// weight of a new frame in the smoothed histogram, 1 follows every frame
+	double alpha = 0.1;
+	// the table is rebuilt when the smoothed P(f) has moved this far, as the sum of
+	// absolute differences (0..2), from the one the table was built from
+	double threshold = 0.02;
+	// map every frame with the table as it was before the frame while counting it,
+	// so a frame is read once, but a rebuild only shows from the next frame on
+	bool single_pass = false;
+};
+
+// what TemporalEqualizer did, the times are those of the last frame
+struct TemporalEqualizerStats {
+	// frames equalized and tables built since construction or reset()
+	long long frames = 0, rebuilds = 0;
+	// milliseconds counting, smoothing and building the table, and mapping,
+	// counting is part of mapping in single pass mode
+	double count_ms = 0, update_ms = 0, map_ms = 0;
+	// distance of the smoothed histogram to the one of the table after the frame
+	double distance = 0;
+	// true if the table was rebuilt for the frame
+	bool rebuilt = false;
+};
+
+// histogram equalization of a CV_8UC1 video without flicker: the histogram is
+// smoothed exponentially over the frames and the table, 255 * C(f) of the
+// smoothed histogram, is only rebuilt when that drifted past opts.threshold,
+// otherwise frames are mapped with the cached one.
+//
+// the first frame, and the first after reset(), builds the table from itself;
+// frames may change size
+class TemporalEqualizer {
+public:
+	explicit TemporalEqualizer(const TemporalEqualizerOptions& opts = TemporalEqualizerOptions());
+
+	// equalize one frame into dst, dst may be src and is only allocated when it
+	// does not have the size and type of src
+	void apply(const cv::Mat& src, cv::Mat& dst);
+	// forget the frames so far, e.g., after a scene cut
+	void reset();
+	const TemporalEqualizerStats& stats() const;
+
+private:
+	TemporalEqualizerOptions opts;
+	HistLut lut;
+	// smoothed P(f) and the one lut was built from
+	double smoothed[256], built[256];
+	TemporalEqualizerStats stat;
+};
+
+// options of the contrast limited adaptive histogram equalizations
+struct ClaheOptions : HistEqualizationOptions {
+	// tiles across and down, fewer when the image has fewer pixels
+	int tiles_x = 8, tiles_y = 8;
+	// the counts of a tile are clipped to clip_limit times their mean, i.e., the
+	// tile area / 256, and the excess is spread over all levels; 0 does not clip
+	double clip_limit = 2.0;
+};
+
+// contrast limited adaptive histogram equalization (CLAHE) of the CV_8UC1 src
+// into dst, e.g., for low-contrast document scans that global equalization blows out
+//
+// every tile gets the table of histogram_equalization_grey from its clipped counts
+// and every pixel is blended from the tables of the four tiles around it, bilinearly
+// with weights in steps of 1/128; pixels outside of the centres of the border tiles
+// take the table of the nearest ones
+// dst may be src and is only allocated when it does not have the size and type of src
+// tiles are counted and rows are blended over the thread pool as opts says,
+// the result does not depend on the number of threads; opts.show_hist is not used
+void clahe_grey(const cv::Mat& src, cv::Mat& dst, const ClaheOptions& opts = ClaheOptions());
+cv::Mat clahe_grey(const cv::Mat&, const ClaheOptions& opts = ClaheOptions());
+
+// clahe_grey of the intensity of a CV_8UC3 image, H and S are kept
+// with no HSI image, as histogram_equalization_color_hsi does with opts.fused: the
+// levels round(sum / 3) are equalized and every pixel is scaled by I' / I, the
+// channels saturate at 255
+// the histograms of the intensity before and after are shown as "hist out" if opts.show_hist
+cv::Mat clahe_color_hsi(const cv::Mat&, const ClaheOptions& opts = ClaheOptions());
 
 // create mosaic image beforehand
 void createMosaicImage(cv::Mat, cv::Mat&, int range);
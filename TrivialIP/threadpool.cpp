@@ -0,0 +1,154 @@
+#include "threadpool.h"
+#include <algorithm>
+#include <atomic>
+
+struct ThreadPool::Job {
+	const std::function<void(int)>* body;
+	int ntasks;
+	// workers allowed to join besides the caller, and workers currently in
+	int max_workers;
+	int workers;
+	std::atomic<int> next;
+	std::atomic<int> done;
+};
+
+ThreadPool::ThreadPool(int nthreads) {
+	if (nthreads <= 0) {
+		nthreads = std::max(1, (int)std::thread::hardware_concurrency());
+	}
+	for (int k = 0; k < nthreads - 1; k++) {
+		workers.emplace_back(&ThreadPool::worker_loop, this);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	job_added.notify_all();
+	for (std::thread& t : workers) {
+		t.join();
+	}
+}
+
+ThreadPool& ThreadPool::global() {
+	static ThreadPool pool;
+	return pool;
+}
+
+// take tasks of job until there is none left
+void ThreadPool::work_on(Job& job) {
+	for (int k = job.next++; k < job.ntasks; k = job.next++) {
+		(*job.body)(k);
+		job.done++;
+	}
+}
+
+void ThreadPool::worker_loop() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		Job* job = nullptr;
+		job_added.wait(lock, [&] {
+			for (Job* j : jobs) {
+				if (j->workers < j->max_workers && j->next < j->ntasks) {
+					job = j;
+					return true;
+				}
+			}
+			return stopping;
+		});
+		if (!job) {
+			return;
+		}
+
+		job->workers++;
+		lock.unlock();
+		work_on(*job);
+		lock.lock();
+		job->workers--;
+		if (job->workers == 0 && job->done == job->ntasks) {
+			job_done.notify_all();
+		}
+	}
+}
+
+void ThreadPool::run(int ntasks, const std::function<void(int)>& body, int max_threads) {
+	if (max_threads <= 0 || max_threads > size()) {
+		max_threads = size();
+	}
+	if (ntasks <= 0) {
+		return;
+	}
+	if (max_threads == 1 || ntasks == 1) {
+		for (int k = 0; k < ntasks; k++) {
+			body(k);
+		}
+		return;
+	}
+
+	Job job;
+	job.body = &body;
+	job.ntasks = ntasks;
+	job.max_workers = std::min(max_threads, ntasks) - 1;
+	job.workers = 0;
+	job.next = 0;
+	job.done = 0;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back(&job);
+	}
+	job_added.notify_all();
+
+	work_on(job);
+
+	// the job lives on this stack, wait until no worker holds it any more
+	std::unique_lock<std::mutex> lock(mutex);
+	job_done.wait(lock, [&] { return job.done == job.ntasks && job.workers == 0; });
+	jobs.remove(&job);
+}
+
+// threads worth using for a job of the given number of pixels
+static int parallel_threads(long long pixels, const ParallelOptions& opts) {
+	// below this many pixels threads cost more than they save
+	const long long min_parallel = 1 << 16;
+	int pool_size = ThreadPool::global().size();
+	if (pixels < min_parallel) {
+		return 1;
+	}
+	return opts.threads > 0 ? std::min(opts.threads, pool_size) : pool_size;
+}
+
+void parallel_for_rows(int begin, int end, int cols, const std::function<void(int, int)>& body,
+	const ParallelOptions& opts) {
+	int rows = end - begin;
+	if (rows <= 0) {
+		return;
+	}
+	int nthreads = parallel_threads((long long)rows * cols, opts);
+
+	// a few tasks per thread keeps them busy when rows cost different amounts
+	int grain = opts.grain > 0 ? opts.grain : std::max(1, (rows + 4 * nthreads - 1) / (4 * nthreads));
+	int ntasks = (rows + grain - 1) / grain;
+	ThreadPool::global().run(ntasks, [&](int k) {
+		int r0 = begin + k * grain;
+		body(r0, std::min(r0 + grain, end));
+	}, nthreads);
+}
+
+void parallel_for_tiles(int rows, int cols, int tile_rows, int tile_cols,
+	const std::function<void(int, int, int, int)>& body, const ParallelOptions& opts) {
+	if (rows <= 0 || cols <= 0) {
+		return;
+	}
+	int nthreads = parallel_threads((long long)rows * cols, opts);
+	tile_rows = std::max(1, opts.grain > 0 ? opts.grain : tile_rows);
+	tile_cols = std::max(1, tile_cols);
+
+	int nx = (cols + tile_cols - 1) / tile_cols;
+	int ntasks = (rows + tile_rows - 1) / tile_rows * nx;
+	ThreadPool::global().run(ntasks, [&](int k) {
+		int r0 = k / nx * tile_rows, c0 = k % nx * tile_cols;
+		body(r0, std::min(r0 + tile_rows, rows), c0, std::min(c0 + tile_cols, cols));
+	}, nthreads);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// options of the functions that can split their work across threads
+struct ParallelOptions {
+	// max threads for one call (the calling thread included),
+	// 0 means every thread of the pool, 1 means run serially
+	int threads = 0;
+	// rows per task, 0 picks one from the image size and the thread count
+	int grain = 0;
+};
+
+// a fixed set of worker threads that are started once and reused by every call
+//
+// the calling thread always works on its own job too, so a pool of n threads
+// has n - 1 workers; several threads may submit jobs at the same time
+class ThreadPool {
+public:
+	// nthreads <= 0 means std::thread::hardware_concurrency()
+	explicit ThreadPool(int nthreads = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// number of threads a job can use, the caller included
+	int size() const { return (int)workers.size() + 1; }
+
+	// run body(k) for every k in [0, ntasks) and return when all are done
+	// at most max_threads threads take part, 0 means size()
+	// body must not throw
+	void run(int ntasks, const std::function<void(int)>& body, int max_threads = 0);
+
+	// the pool shared by the library, created on first use
+	static ThreadPool& global();
+
+private:
+	struct Job;
+
+	void worker_loop();
+	static void work_on(Job& job);
+
+	std::vector<std::thread> workers;
+	std::list<Job*> jobs;
+	std::mutex mutex;
+	std::condition_variable job_added, job_done;
+	bool stopping = false;
+};
+
+// split the rows [begin, end) of an image with cols columns into tasks and
+// run body(row_begin, row_end) for each of them on the global pool
+// results only depend on how the rows are processed, not on the threads, so
+// kernels that write disjoint rows give the same output as a serial call
+void parallel_for_rows(int begin, int end, int cols, const std::function<void(int, int)>& body,
+	const ParallelOptions& opts = ParallelOptions());
+
+// same for 2D tiles of tile_rows x tile_cols of a rows x cols image,
+// body(row_begin, row_end, col_begin, col_end) is called once per tile
+// opts.grain, when given, replaces tile_rows
+void parallel_for_tiles(int rows, int cols, int tile_rows, int tile_cols,
+	const std::function<void(int, int, int, int)>& body, const ParallelOptions& opts = ParallelOptions());
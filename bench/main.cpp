@@ -0,0 +1,498 @@
+// benchmarks of the TrivialIP image library
+// build together with ../TrivialIP/iplib.cpp and ../TrivialIP/threadpool.cpp
+//
+// usage: bench <name> [args]
+// run one mode per process under `perf stat -e cache-misses,dTLB-load-misses`
+// (or VTune on Windows) to get the miss rates next to the timings printed here
+#define _USE_MATH_DEFINES
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include "../TrivialIP/iplib.h"
+
+static double now_ms() {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// smooth synthetic 8-bit image, random noise would hide interpolation costs
+static cv::Mat synthetic_image(int rows, int cols, int type) {
+	cv::Mat img(rows, cols, type);
+	int n = cols * img.channels();
+	for (int i = 0; i < rows; i++) {
+		uchar* p = img.ptr<uchar>(i);
+		for (int j = 0; j < n; j++) {
+			p[j] = (uchar)(128 + 100 * sin(i * 0.05 + j * 0.013));
+		}
+	}
+	return img;
+}
+
+// rotation by deg degrees around the image centre, as the GUI builds it
+static cv::Mat rotation_matrix(double deg, int cols, int rows) {
+	cv::Mat M = cv::Mat::zeros(2, 3, CV_64FC1);
+	double theta = deg * M_PI / 180, co = cos(theta), si = sin(theta);
+	M.at<double>(0, 0) = co;
+	M.at<double>(0, 1) = -si;
+	M.at<double>(0, 2) = (cols + rows * si - cols * co) / 2;
+	M.at<double>(1, 0) = si;
+	M.at<double>(1, 1) = co;
+	M.at<double>(1, 2) = (rows - rows * co - cols * si) / 2;
+	return M;
+}
+
+// row-major scan versus tiled traversal of warpAffine on an 8K frame
+// args: [rows|tiles|both] [threads]
+static int bench_warp_tiles(int argc, char** argv) {
+	std::string mode = argc > 0 ? argv[0] : "both";
+	int threads = argc > 1 ? std::stoi(argv[1]) : 1;
+	const double angles[] = { 0, 15, 45, 90 };
+	const int repeat = 3;
+
+	cv::Mat src = synthetic_image(4320, 7680, CV_8UC3);
+	std::cout << "warpAffine 7680x4320 CV_8UC3, threads " << threads << std::endl;
+
+	for (double deg : angles) {
+		cv::Mat M = rotation_matrix(deg, src.cols, src.rows), dst;
+		for (int traversal : { WARP_TRAVERSE_ROWS, WARP_TRAVERSE_TILES }) {
+			const char* name = traversal == WARP_TRAVERSE_ROWS ? "rows" : "tiles";
+			if (mode != "both" && mode != name) {
+				continue;
+			}
+
+			WarpOptions opts;
+			opts.threads = threads;
+			opts.traversal = traversal;
+			cv::Size dsize;
+			double best = 1e30;
+			for (int k = 0; k < repeat; k++) {
+				double t = now_ms();
+				warpAffine(src, dst, M, dsize, opts);
+				best = std::min(best, now_ms() - t);
+			}
+			std::cout << "  " << deg << " deg  " << name << "  " << best << " ms  "
+				<< dst.total() / best / 1e3 << " MPix/s" << std::endl;
+		}
+	}
+	return 0;
+}
+
+// axis-aligned downscaling of an 8K frame with and without the box pre-reduction
+// args: [threads]
+static int bench_warp_downscale(int argc, char** argv) {
+	int threads = argc > 0 ? std::stoi(argv[0]) : 1;
+	const double factors[] = { 0.5, 0.25, 0.1 };
+	const int repeat = 5;
+
+	cv::Mat src = synthetic_image(4320, 7680, CV_8UC3);
+	std::cout << "warpAffine 7680x4320 CV_8UC3 downscale, threads " << threads << std::endl;
+
+	for (double f : factors) {
+		cv::Mat M = cv::Mat::zeros(2, 3, CV_64FC1), dst;
+		M.at<double>(0, 0) = f;
+		M.at<double>(1, 1) = f;
+		for (bool antialias : { false, true }) {
+			WarpOptions opts;
+			opts.threads = threads;
+			opts.antialias = antialias;
+			cv::Size dsize;
+			double best = 1e30;
+			for (int k = 0; k < repeat; k++) {
+				double t = now_ms();
+				warpAffine(src, dst, M, dsize, opts);
+				best = std::min(best, now_ms() - t);
+			}
+			std::cout << "  " << f << "x  " << (antialias ? "box+bilinear" : "bilinear") << "  " << best << " ms  "
+				<< src.total() / best / 1e3 << " src MPix/s" << std::endl;
+		}
+	}
+	return 0;
+}
+
+// warpPerspective against warpAffine on an 8K frame rotated by 10 degrees, the
+// homography adds a slight tilt to the same rotation
+// args: [threads]
+static int bench_warp_perspective(int argc, char** argv) {
+	int threads = argc > 0 ? std::stoi(argv[0]) : 1;
+	const char* names[] = { "nearest", "linear", "cubic", "lanczos3" };
+	const int repeat = 3;
+
+	cv::Mat src = synthetic_image(4320, 7680, CV_8UC3), dst;
+	cv::Mat A = rotation_matrix(10, src.cols, src.rows), H = cv::Mat::zeros(3, 3, CV_64FC1);
+	for (int k = 0; k < 6; k++) {
+		H.at<double>(k / 3, k % 3) = A.at<double>(k / 3, k % 3);
+	}
+	H.at<double>(2, 2) = 1;
+	H.at<double>(2, 0) = 1e-5;
+	H.at<double>(2, 1) = 1e-5;
+	std::cout << "warpPerspective vs warpAffine 7680x4320 CV_8UC3, threads " << threads << std::endl;
+
+	for (int interpolation = WARP_INTER_NEAREST; interpolation <= WARP_INTER_LANCZOS3; interpolation++) {
+		WarpOptions opts;
+		opts.threads = threads;
+		opts.interpolation = interpolation;
+		double best[2] = { 1e30, 1e30 };
+		for (int k = 0; k < repeat; k++) {
+			cv::Size dsize = src.size();
+			double t = now_ms();
+			warpAffine(src, dst, A, dsize, opts);
+			best[0] = std::min(best[0], now_ms() - t);
+			t = now_ms();
+			warpPerspective(src, dst, H, dsize, opts);
+			best[1] = std::min(best[1], now_ms() - t);
+		}
+		std::cout << "  " << names[interpolation] << "  affine " << best[0] << " ms  perspective " << best[1] << " ms  ratio "
+			<< best[1] / best[0] << std::endl;
+	}
+	return 0;
+}
+
+// deskew of a 30000x30000 CV_8UC1 scan through warpAffineStream, src rows are
+// made up by the reader and dst rows are dropped by the writer, so only the
+// window and strip of the stream are ever resident
+// args: [max MB] [threads]
+static int bench_warp_stream(int argc, char** argv) {
+	int max_mb = argc > 0 ? std::stoi(argv[0]) : 256;
+	int threads = argc > 1 ? std::stoi(argv[1]) : 0;
+	const int size = 30000;
+
+	cv::Mat tile = synthetic_image(1024, size, CV_8UC1);
+	long long read = 0, written = 0;
+	WarpRowReader reader = [&](int y, cv::Mat& rows) {
+		for (int i = 0; i < rows.rows; i++) {
+			memcpy(rows.ptr(i), tile.ptr((y + i) % tile.rows), size);
+		}
+		read += rows.rows;
+		return true;
+	};
+	WarpRowWriter writer = [&](int, const cv::Mat& rows) {
+		written += rows.rows;
+		return true;
+	};
+
+	WarpStreamOptions opts;
+	opts.threads = threads;
+	opts.max_bytes = (size_t)max_mb << 20;
+	cv::Size dsize;
+	double t = now_ms();
+	bool ok = warpAffineStream(cv::Size(size, size), CV_8UC1, reader, rotation_matrix(1.5, size, size), dsize, writer, opts);
+	t = now_ms() - t;
+	std::cout << "warpAffineStream 30000x30000 CV_8UC1 rotated 1.5 degrees, max " << max_mb << " MB, threads " << threads
+		<< std::endl;
+	std::cout << "  " << (ok ? "" : "failed, ") << t << " ms  " << (double)size * size / t / 1e3 << " src MPix/s  src rows read "
+		<< read << " of " << size << ", dst rows written " << written << std::endl;
+	return ok ? 0 : 1;
+}
+
+// count_hist_grey on 8K frames of one level, of noise and of a smooth gradient,
+// a plain loop over one counter stalls on the first since every increment waits
+// for the previous one
+// args: [threads]
+static int bench_hist(int argc, char** argv) {
+	int threads = argc > 0 ? std::stoi(argv[0]) : 0;
+	const int repeat = 5;
+
+	cv::Mat flat(4320, 7680, CV_8UC1, cv::Scalar(240)), noise(4320, 7680, CV_8UC1);
+	unsigned seed = 1;
+	for (int i = 0; i < noise.rows; i++) {
+		uchar* p = noise.ptr<uchar>(i);
+		for (int j = 0; j < noise.cols; j++) {
+			seed = seed * 1103515245 + 12345;
+			p[j] = (uchar)(seed >> 24);
+		}
+	}
+	cv::Mat smooth = synthetic_image(4320, 7680, CV_8UC1);
+
+	ParallelOptions opts;
+	opts.threads = threads;
+	std::cout << "count_hist_grey 7680x4320 CV_8UC1, threads " << threads << std::endl;
+	const char* names[] = { "flat", "noise", "smooth" };
+	const cv::Mat* imgs[] = { &flat, &noise, &smooth };
+	for (int k = 0; k < 3; k++) {
+		double naive = 1e30, banked = 1e30;
+		for (int r = 0; r < repeat; r++) {
+			std::vector<int> hist(256);
+			double t = now_ms();
+			for (int i = 0; i < imgs[k]->rows; i++) {
+				const uchar* p = imgs[k]->ptr<uchar>(i);
+				for (int j = 0; j < imgs[k]->cols; j++) {
+					hist[p[j]]++;
+				}
+			}
+			naive = std::min(naive, now_ms() - t);
+			t = now_ms();
+			std::vector<int> counted = count_hist_grey(*imgs[k], opts);
+			banked = std::min(banked, now_ms() - t);
+			if (counted != hist) {
+				std::cout << "  " << names[k] << " counts differ" << std::endl;
+				return 1;
+			}
+		}
+		std::cout << "  " << names[k] << "  naive " << naive << " ms  count_hist_grey " << banked << " ms" << std::endl;
+	}
+	return 0;
+}
+
+// histogram_equalization_color_hsi of a 20 MP frame through the HSI round trip
+// and fused, the latter also in place
+// args: [threads]
+static int bench_hist_color(int argc, char** argv) {
+	HistEqualizationOptions opts;
+	opts.threads = argc > 0 ? std::stoi(argv[0]) : 0;
+	opts.show_hist = false;
+	const int repeat = 3;
+
+	cv::Mat src = synthetic_image(3648, 5472, CV_8UC3), dst, inplace;
+	double hsi = 1e30, fused = 1e30, in_place = 1e30;
+	for (int k = 0; k < repeat; k++) {
+		opts.fused = false;
+		double t = now_ms();
+		histogram_equalization_color_hsi(src, dst, opts);
+		hsi = std::min(hsi, now_ms() - t);
+		opts.fused = true;
+		t = now_ms();
+		histogram_equalization_color_hsi(src, dst, opts);
+		fused = std::min(fused, now_ms() - t);
+		src.copyTo(inplace);
+		t = now_ms();
+		histogram_equalization_color_hsi(inplace, inplace, opts);
+		in_place = std::min(in_place, now_ms() - t);
+	}
+	std::cout << "histogram_equalization_color_hsi 5472x3648 CV_8UC3, threads " << opts.threads << std::endl;
+	std::cout << "  hsi " << hsi << " ms  fused " << fused << " ms  in place " << in_place << " ms" << std::endl;
+	return 0;
+}
+
+// clahe_grey on a 20 MP document-like frame, run with 1, 2, 4, ... threads to
+// see how it scales with the cores
+// args: [threads] [tiles] [clip limit]
+static int bench_clahe(int argc, char** argv) {
+	ClaheOptions opts;
+	opts.threads = argc > 0 ? std::stoi(argv[0]) : 0;
+	opts.tiles_x = opts.tiles_y = argc > 1 ? std::stoi(argv[1]) : 8;
+	opts.clip_limit = argc > 2 ? std::stod(argv[2]) : 2.0;
+	const int repeat = 5;
+
+	cv::Mat src = synthetic_image(3648, 5472, CV_8UC1), dst;
+	double best = 1e30;
+	for (int k = 0; k < repeat; k++) {
+		double t = now_ms();
+		clahe_grey(src, dst, opts);
+		best = std::min(best, now_ms() - t);
+	}
+	std::cout << "clahe_grey 5472x3648 CV_8UC1, " << opts.tiles_x << "x" << opts.tiles_y << " tiles, clip "
+		<< opts.clip_limit << ", threads " << opts.threads << std::endl;
+	std::cout << "  " << best << " ms  " << src.total() / best / 1e3 << " MPix/s" << std::endl;
+	return 0;
+}
+
+// IntegralHistogram of a 20 MP frame: build time, table size and the time of
+// queries of random rectangles
+// args: [bins] [threads]
+static int bench_integral_hist(int argc, char** argv) {
+	int bins = argc > 0 ? std::stoi(argv[0]) : 16;
+	ParallelOptions opts;
+	opts.threads = argc > 1 ? std::stoi(argv[1]) : 0;
+	const int queries = 100000;
+
+	cv::Mat src = synthetic_image(3648, 5472, CV_8UC1);
+	double t = now_ms();
+	IntegralHistogram ih(src, bins, opts);
+	double build = now_ms() - t;
+	if (ih.empty()) {
+		return 1;
+	}
+
+	unsigned seed = 1;
+	auto next = [&](int n) {
+		seed = seed * 1103515245 + 12345;
+		return (int)((seed >> 8) % n);
+	};
+	std::vector<int> counts(bins);
+	long long sum = 0;
+	t = now_ms();
+	for (int k = 0; k < queries; k++) {
+		cv::Rect r(next(src.cols), next(src.rows), next(src.cols), next(src.rows));
+		ih.hist(r, counts.data());
+		sum += counts[bins / 2];
+	}
+	double query = (now_ms() - t) / queries;
+	std::cout << "IntegralHistogram 5472x3648 CV_8UC1, " << bins << " bins, threads " << opts.threads << std::endl;
+	std::cout << "  build " << build << " ms  tables " << ih.table_bytes() / (1 << 20) << " MB  query "
+		<< query * 1e3 << " us  (" << sum << ")" << std::endl;
+	return 0;
+}
+
+// convert_rgb_to_hsi of a 20 MP frame to each of its four layouts and
+// convert_hsi_to_rgb back from it
+// args: [threads]
+static int bench_hsi(int argc, char** argv) {
+	ParallelOptions opts;
+	opts.threads = argc > 0 ? std::stoi(argv[0]) : 0;
+	const int repeat = 5;
+
+	cv::Mat src = synthetic_image(3648, 5472, CV_8UC3);
+	std::cout << "convert_rgb_to_hsi and back, 5472x3648 CV_8UC3, threads " << opts.threads << std::endl;
+	for (int depth : { CV_32F, CV_16U }) {
+		for (int planar = 1; planar >= 0; planar--) {
+			cv::Mat hsi, planes[3], back;
+			double to = 1e30, from = 1e30;
+			for (int k = 0; k < repeat; k++) {
+				double t = now_ms();
+				if (planar) {
+					convert_rgb_to_hsi(src, planes, depth, opts);
+				}
+				else {
+					convert_rgb_to_hsi(src, hsi, depth, opts);
+				}
+				to = std::min(to, now_ms() - t);
+				t = now_ms();
+				if (planar) {
+					convert_hsi_to_rgb(planes, back, opts);
+				}
+				else {
+					convert_hsi_to_rgb(hsi, back, opts);
+				}
+				from = std::min(from, now_ms() - t);
+			}
+			std::cout << "  " << (depth == CV_32F ? "float32 " : "16-bit  ") << (planar ? "planar      " : "interleaved ")
+				<< "to " << to << " ms  back " << from << " ms  (" << src.total() / from / 1e3 << " MPix/s)" << std::endl;
+		}
+	}
+	return 0;
+}
+
+// a white balance and a gamma on a 20 MP frame as a float pass per pixel and as
+// ColorLut of 17^3, 33^3 and 65^3 nodes: bake, cached bake and apply
+// args: [threads]
+static int bench_color_lut(int argc, char** argv) {
+	ParallelOptions opts;
+	opts.threads = argc > 0 ? std::stoi(argv[0]) : 0;
+	const int repeat = 3;
+
+	ColorFunction fn = [](const float in[3], float out[3]) {
+		const float gain[3] = { 1.1f, 1.0f, 0.85f };
+		for (int k = 0; k < 3; k++) {
+			out[k] = 255 * std::pow(std::min(in[k] * gain[k], 255.f) / 255, 1 / 2.2f);
+		}
+	};
+	cv::Mat src = synthetic_image(3648, 5472, CV_8UC3), dst(src.size(), CV_8UC3);
+	double t = now_ms();
+	for (int i = 0; i < src.rows; i++) {
+		const uchar* p = src.ptr(i);
+		uchar* q = dst.ptr(i);
+		for (int j = 0; j < src.cols; j++) {
+			float in[3] = { (float)p[3 * j], (float)p[3 * j + 1], (float)p[3 * j + 2] }, out[3];
+			fn(in, out);
+			for (int k = 0; k < 3; k++) {
+				q[3 * j + k] = cv::saturate_cast<uchar>(out[k]);
+			}
+		}
+	}
+	std::cout << "white balance and gamma 5472x3648 CV_8UC3, threads " << opts.threads << std::endl;
+	std::cout << "  per pixel " << now_ms() - t << " ms" << std::endl;
+
+	ColorLut::clear_cache();
+	for (int size : { 17, 33, 65 }) {
+		t = now_ms();
+		ColorLut lut = ColorLut::cached("wb 1.1 1 0.85 gamma 2.2", size, fn, opts);
+		double bake = now_ms() - t;
+		t = now_ms();
+		lut = ColorLut::cached("wb 1.1 1 0.85 gamma 2.2", size, fn, opts);
+		double cached = now_ms() - t, apply = 1e30;
+		for (int k = 0; k < repeat; k++) {
+			t = now_ms();
+			lut.apply(src, dst, opts);
+			apply = std::min(apply, now_ms() - t);
+		}
+		std::cout << "  " << size << "^3  bake " << bake << " ms  cached " << cached << " ms  apply " << apply
+			<< " ms  table " << lut.table_bytes() / 1024 << " KB" << std::endl;
+	}
+	return 0;
+}
+
+// a 20 MP frame split to a PlanarImage and merged back, and the HSI round trip
+// and the fused color equalization on interleaved and on planar BGR
+// args: [threads]
+static int bench_planar(int argc, char** argv) {
+	HistEqualizationOptions opts;
+	opts.threads = argc > 0 ? std::stoi(argv[0]) : 0;
+	opts.show_hist = false;
+	opts.fused = true;
+	const int repeat = 5;
+
+	cv::Mat src = synthetic_image(3648, 5472, CV_8UC3), back;
+	PlanarImage bgr, hsi, planar_back;
+	std::cout << "PlanarImage, 5472x3648 CV_8UC3, threads " << opts.threads << std::endl;
+	double split = 1e30, merge = 1e30;
+	for (int k = 0; k < repeat; k++) {
+		double t = now_ms();
+		split_planar(src, bgr, opts);
+		split = std::min(split, now_ms() - t);
+		t = now_ms();
+		merge_planar(bgr, back, opts);
+		merge = std::min(merge, now_ms() - t);
+	}
+	std::cout << "  split " << split << " ms  merge " << merge << " ms" << std::endl;
+
+	for (int planar = 0; planar <= 1; planar++) {
+		cv::Mat hsi_mat, eq;
+		PlanarImage planar_eq;
+		double round = 1e30, equalize = 1e30;
+		for (int k = 0; k < repeat; k++) {
+			double t = now_ms();
+			if (planar) {
+				convert_rgb_to_hsi(bgr, hsi, CV_32F, opts);
+				convert_hsi_to_rgb(hsi, planar_back, opts);
+			}
+			else {
+				convert_rgb_to_hsi(src, hsi_mat, CV_32F, opts);
+				convert_hsi_to_rgb(hsi_mat, back, opts);
+			}
+			round = std::min(round, now_ms() - t);
+			t = now_ms();
+			if (planar) {
+				histogram_equalization_color_hsi(bgr, planar_eq, opts);
+			}
+			else {
+				histogram_equalization_color_hsi(src, eq, opts);
+			}
+			equalize = std::min(equalize, now_ms() - t);
+		}
+		std::cout << "  " << (planar ? "planar      " : "interleaved ") << "hsi round trip " << round
+			<< " ms  fused equalization " << equalize << " ms" << std::endl;
+	}
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	struct {
+		const char* name;
+		int (*run)(int, char**);
+	} benches[] = {
+		{ "warp-tiles", bench_warp_tiles },
+		{ "warp-downscale", bench_warp_downscale },
+		{ "warp-perspective", bench_warp_perspective },
+		{ "warp-stream", bench_warp_stream },
+		{ "hist", bench_hist },
+		{ "hist-color", bench_hist_color },
+		{ "clahe", bench_clahe },
+		{ "integral-hist", bench_integral_hist },
+		{ "hsi", bench_hsi },
+		{ "color-lut", bench_color_lut },
+		{ "planar", bench_planar },
+	};
+
+	for (auto& b : benches) {
+		if (argc > 1 && !strcmp(argv[1], b.name)) {
+			return b.run(argc - 2, argv + 2);
+		}
+	}
+
+	std::cout << "usage: bench <name> [args]" << std::endl;
+	for (auto& b : benches) {
+		std::cout << "  " << b.name << std::endl;
+	}
+	return 1;
+}
@@ -3,6 +3,7 @@
 #include <cmath>
 #include <iostream>
 #include <algorithm>
+#include <vector>
 #include <opencv.hpp>
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
@@ -11,6 +12,8 @@ cv::Mat histogram_equalization_grey(cv::Mat&);
 cv::Mat histogram_equalization_color_hsi(cv::Mat&);
 cv::Mat cal_hist_grey(cv::Mat&);
 cv::Mat cal_hist_color(cv::Mat&);
+std::vector<int> count_hist_grey(const cv::Mat&);
+std::vector<int> count_hist_color(const cv::Mat&);
 
 const int hist_width = 512, hist_height = 420, bin_width = hist_width / 256;
 
@@ -53,20 +56,16 @@ cv::Mat histogram_equalization_grey(cv::Mat& img) {
 	}
 
 	const int min = 0, max = 255;
-	int value[max + 1] = { 0 };
+	int value[max + 1];
 	double hist[max + 1];
 	int row = img.rows, col = img.cols;
 
 	// count the times each grey value occurs
-	for (int i = 0; i < row; i++) {
-		for (int j = 0; j < col; j++) {
-			value[img.at<uchar>(i, j)]++;
-		}
-	}
+	std::vector<int> frequency = count_hist_grey(img);
 
 	// calculate P(f) and C(f)
 	for (int i = 0; i <= max; i++) {
-		hist[i] = (double)value[i] / (row * col);
+		hist[i] = (double)frequency[i] / (row * col);
 		if (i > 0)
 			hist[i] += hist[i - 1];
 	}
@@ -204,18 +203,49 @@ cv::Mat hsi_to_rgb(cv::Mat& hsi) {
 	return rgb;
 }
 
+// count the times each grey level occurs in a CV_8U image
+// equal neighbours would increment one counter back to back and wait for each
+// store, so the bytes are spread over four sub-histograms, eight per iteration,
+// and the rows of a continuous image are counted as one buffer
+std::vector<int> count_hist_grey(const cv::Mat& img) {
+	int bank[4][256] = { 0 };
+	int rows = img.rows, cols = img.cols;
+	if (img.isContinuous()) {
+		cols *= rows;
+		rows = 1;
+	}
+
+	for (int i = 0; i < rows; i++) {
+		const uchar* p = img.ptr<uchar>(i);
+		int j = 0;
+		for (; j + 8 <= cols; j += 8) {
+			bank[0][p[j]]++;
+			bank[1][p[j + 1]]++;
+			bank[2][p[j + 2]]++;
+			bank[3][p[j + 3]]++;
+			bank[0][p[j + 4]]++;
+			bank[1][p[j + 5]]++;
+			bank[2][p[j + 6]]++;
+			bank[3][p[j + 7]]++;
+		}
+		for (; j < cols; j++) {
+			bank[0][p[j]]++;
+		}
+	}
+
+	std::vector<int> hist(256);
+	for (int v = 0; v < 256; v++) {
+		hist[v] = bank[0][v] + bank[1][v] + bank[2][v] + bank[3][v];
+	}
+	return hist;
+}
+
 // calculate the histogram of a grey scale image
 // return a Mat that can be directly plotted
 cv::Mat cal_hist_grey(cv::Mat& img) {
 	cv::Mat hist_img = cv::Mat(hist_height, hist_width, CV_8UC3, cv::Scalar(225, 228, 255));
-	int frequency[256] = {0};
+	std::vector<int> frequency = count_hist_grey(img);
 	double hist[256], hist_max;
-	
-	for (int i = 0; i < img.rows; i++) {
-		for (int j = 0; j < img.cols; j++) {
-			frequency[img.at<uchar>(i, j)]++;
-		}
-	}
 
 	hist_max = -1;
 	for (int i = 0; i <= 255; i++) {
@@ -230,5 +260,71 @@ cv::Mat cal_hist_grey(cv::Mat& img) {
 			cv::Scalar(205, 0, 0), 2, cv::LINE_AA);
 	}
 
+	return hist_img;
+}
+
+// count the times each level occurs in every channel of a CV_8UC3 image
+// the interleaved pixels are walked once, two at a time into two banks per
+// channel, instead of splitting the planes and counting each of them
+// return 3 * 256 counts, B first
+std::vector<int> count_hist_color(const cv::Mat& img) {
+	int bank[2][3][256] = { 0 };
+	int rows = img.rows, cols = img.cols;
+	if (img.isContinuous()) {
+		cols *= rows;
+		rows = 1;
+	}
+
+	for (int i = 0; i < rows; i++) {
+		const uchar* p = img.ptr<uchar>(i);
+		int j = 0;
+		for (; j + 2 <= cols; j += 2, p += 6) {
+			bank[0][0][p[0]]++;
+			bank[0][1][p[1]]++;
+			bank[0][2][p[2]]++;
+			bank[1][0][p[3]]++;
+			bank[1][1][p[4]]++;
+			bank[1][2][p[5]]++;
+		}
+		if (j < cols) {
+			bank[0][0][p[0]]++;
+			bank[0][1][p[1]]++;
+			bank[0][2][p[2]]++;
+		}
+	}
+
+	std::vector<int> hist(3 * 256);
+	for (int c = 0; c < 3; c++) {
+		for (int v = 0; v < 256; v++) {
+			hist[256 * c + v] = bank[0][c][v] + bank[1][c][v];
+		}
+	}
+	return hist;
+}
+
+// calculate the histogram of every channel of a color image
+// return a Mat that can be directly plotted, one curve per channel in its color
+cv::Mat cal_hist_color(cv::Mat& img) {
+	cv::Mat hist_img = cv::Mat(hist_height, hist_width, CV_8UC3, cv::Scalar(225, 228, 255));
+	if (img.type() != CV_8UC3) {
+		std::cout << "cal_hist_color: img's not CV_8UC3\n";
+		return hist_img;
+	}
+	std::vector<int> frequency = count_hist_color(img);
+	int hist_max = *std::max_element(frequency.begin(), frequency.end());
+	if (hist_max <= 0) {
+		return hist_img;
+	}
+
+	for (int c = 0; c < 3; c++) {
+		const int* hist = &frequency[256 * c];
+		cv::Scalar color(c == 0 ? 205 : 0, c == 1 ? 205 : 0, c == 2 ? 205 : 0);
+		for (int i = 0; i < 255; i++) {
+			cv::line(hist_img, cv::Point(i * bin_width, (int)(hist_height * (1 - (double)hist[i] / hist_max))),
+				cv::Point((i + 1) * bin_width, (int)(hist_height * (1 - (double)hist[i + 1] / hist_max))),
+				color, 2, cv::LINE_AA);
+		}
+	}
+
 	return hist_img;
 }
\ No newline at end of file
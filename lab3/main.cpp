@@ -109,7 +109,9 @@ int main() {
 }
 
 void warpAffine(const cv::Mat& src, cv::Mat& dst, const cv::Mat& M, cv::Size& dsize) {
-	const int eps = 1e-9;
+	const double eps = 1e-9;
+	// 16.16 fixed point source coordinates, 7-bit bilinear weights
+	const int fix_bits = 16, inter_bits = 7, inter_size = 1 << inter_bits;
 	int row = src.rows;
 	int col = src.cols;
 	int channel = src.channels();
@@ -128,41 +130,45 @@ void warpAffine(const cv::Mat& src, cv::Mat& dst, const cv::Mat& M, cv::Size& ds
 	double ty = M.at<double>(1, 2);
 	double det = a * d - b * c;
 
+	if (std::abs(det) < 1e-12) {
+		std::cerr << "M is not invertible!" << std::endl;
+		return;
+	}
+
 	// resize dst image
 	int resized_row = (int)(row * sqrt(c * c + d * d) + eps);
 	int resized_col = (int)(col * sqrt(a * a + b * b) + eps);
 	dst = cv::Mat::zeros(resized_row, resized_col, CV_8UC3);
 
-	// parameters for loop
-	int _x, _y;
-	double dx, dy;
-	double x_original, y_original;
+	// the original point moves by (DX, DY) when j increases by one
+	int DX = cvRound(d / det * (1 << fix_bits));
+	int DY = cvRound(-c / det * (1 << fix_bits));
+	unsigned xmax = (unsigned)(col - 1) << fix_bits;
+	unsigned ymax = (unsigned)(row - 1) << fix_bits;
+	size_t sstep = src.step;
 
 	// affine transformation
 	// i is on y axis, j is on x axis
 	for (int i = 0; i < resized_row; i++) {
-		for (int j = 0; j < resized_col; j++) {
-			// original point
+		// original point of the first pixel in this row
+		unsigned X = cvRound((ty * b - tx * d - b * i) / det * (1 << fix_bits));
+		unsigned Y = cvRound((a * i + tx * c - ty * a) / det * (1 << fix_bits));
+		uchar* out = dst.ptr<uchar>(i);
+
+		for (int j = 0; j < resized_col; j++, X += DX, Y += DY, out += 3) {
 			// -1 for binear interpolation
-			x_original = (d * j - b * i + ty * b - tx * d) / det;
-			y_original = (a * i - c * j + tx * c - ty * a) / det;
-			if ((x_original < 0) || (x_original >= col-1)) {
-				continue;
-			}
-			if ((y_original < 0) || (y_original >= row-1)) {
+			if (X >= xmax || Y >= ymax) {
 				continue;
 			}
 
-			// binear interpolation
-			_x = (int)x_original;
-			_y = (int)y_original;
-			dx = x_original - _x;
-			dy = y_original - _y;
+			// binear interpolation with integer weights
+			const uchar* p = src.data + (Y >> fix_bits) * sstep + (X >> fix_bits) * 3;
+			int fx = (X >> (fix_bits - inter_bits)) & (inter_size - 1);
+			int fy = (Y >> (fix_bits - inter_bits)) & (inter_size - 1);
 			for (int c = 0; c < channel; c++) {
-				dst.at<cv::Vec3b>(i, j)[c] = (1 - dx) * (1 - dy) * src.at<cv::Vec3b>(_y, _x)[c] +
-					dx * (1 - dy) * src.at<cv::Vec3b>(_y, _x + 1)[c] +
-					(1 - dx) * dy * src.at<cv::Vec3b>(_y + 1, _x)[c] +
-					dx * dy * src.at<cv::Vec3b>(_y + 1, _x + 1)[c];
+				int top = p[c] * (inter_size - fx) + p[c + 3] * fx;
+				int bot = p[sstep + c] * (inter_size - fx) + p[sstep + c + 3] * fx;
+				out[c] = (uchar)((top * (inter_size - fy) + bot * fy + (1 << (2 * inter_bits - 1))) >> (2 * inter_bits));
 			}
 		}
 	}